@@ -0,0 +1,244 @@
+/*
+ * compress - write precompressed siblings of output files
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "compress.h"
+#include "debug.h"
+
+int compress_parse_methods(const char *list) {
+	int mask = 0;
+	const char *it = list;
+	size_t len;
+
+	while (*it != 0) {
+		len = strcspn(it, ",");
+		if (len == 4 && strncmp(it, "gzip", 4) == 0)
+			mask |= compress_gzip;
+		else if (len == 2 && strncmp(it, "br", 2) == 0)
+			mask |= compress_brotli;
+		else if (len == 3 && strncmp(it, "all", 3) == 0)
+			mask |= COMPRESS_ALL;
+		else
+			return -1;
+
+		it += len;
+		if (*it == ',')
+			it++;
+	}
+
+	return mask;
+}
+
+const char *compress_suffix(enum compress_method method) {
+	switch (method) {
+	case compress_gzip:
+		return ".gz";
+	case compress_brotli:
+		return ".br";
+	}
+
+	return NULL;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+	const char *it = buf;
+	ssize_t part;
+
+	while (len > 0) {
+		part = write(fd, it, len);
+		if (part < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		it += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+static int write_gzip(int fd, const void *data, size_t len) {
+	gzFile gz;
+	int ret = 0;
+
+	/* gzclose closes the descriptor, so hand over a duplicate */
+	gz = gzdopen(dup(fd), "wb9");
+	if (gz == NULL)
+		return -ENOMEM;
+
+	/* gzwrite takes an unsigned length, feed it in 1G-blocks */
+	while (len > 0 && ret == 0) {
+		unsigned part = len > (1 << 30) ? (1 << 30) : len;
+		if (gzwrite(gz, data, part) != (int)part)
+			ret = -EIO;
+		data = (const char *)data + part;
+		len -= part;
+	}
+
+	if (gzclose(gz) != Z_OK && ret == 0)
+		ret = -EIO;
+
+	return ret;
+}
+
+static int write_brotli(int fd, const void *data, size_t len) {
+	size_t out_len = BrotliEncoderMaxCompressedSize(len);
+	uint8_t *out;
+	int ret;
+
+	/* Empty input gives a max size of 0, but still needs a stream */
+	if (out_len == 0)
+		out_len = 16;
+
+	out = malloc(out_len);
+	if (out == NULL)
+		return -ENOMEM;
+
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+				BROTLI_MODE_TEXT, len, data, &out_len, out)) {
+		free(out);
+		return -EIO;
+	}
+
+	ret = write_all(fd, out, out_len);
+	free(out);
+
+	return ret;
+}
+
+int compress_file(const char *filename, enum compress_method method) {
+	struct stat src_stat, dst_stat;
+	struct timespec times[2];
+	char *dst_name, *tmp_name;
+	void *data = NULL;
+	int src_fd, tmp_fd;
+	int ret;
+
+	if (asprintf(&dst_name, "%s%s", filename, compress_suffix(method)) < 0)
+		return -ENOMEM;
+	if (asprintf(&tmp_name, "%s.tmp", dst_name) < 0) {
+		free(dst_name);
+		return -ENOMEM;
+	}
+
+	src_fd = open(filename, O_RDONLY);
+	if (src_fd < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+	if (fstat(src_fd, &src_stat)) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	/* Siblings carry the mtime of the content they were made from, so an
+	 * identical mtime means that the content has not changed */
+	if (stat(dst_name, &dst_stat) == 0 &&
+			dst_stat.st_mtim.tv_sec == src_stat.st_mtim.tv_sec &&
+			dst_stat.st_mtim.tv_nsec == src_stat.st_mtim.tv_nsec) {
+		DBG("compress: %s is up to date", dst_name);
+		ret = 0;
+		goto out_close;
+	}
+
+	if (src_stat.st_size > 0) {
+		data = mmap(NULL, src_stat.st_size, PROT_READ, MAP_PRIVATE,
+				src_fd, 0);
+		if (data == MAP_FAILED) {
+			ret = -errno;
+			goto out_close;
+		}
+	}
+
+	tmp_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (tmp_fd < 0) {
+		ret = -errno;
+		goto out_unmap;
+	}
+
+	switch (method) {
+	case compress_gzip:
+		ret = write_gzip(tmp_fd, data, src_stat.st_size);
+		break;
+	case compress_brotli:
+		ret = write_brotli(tmp_fd, data, src_stat.st_size);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	times[0] = src_stat.st_atim;
+	times[1] = src_stat.st_mtim;
+	if (ret == 0 && futimens(tmp_fd, times))
+		ret = -errno;
+	if (close(tmp_fd) && ret == 0)
+		ret = -errno;
+
+	if (ret == 0 && rename(tmp_name, dst_name))
+		ret = -errno;
+	if (ret < 0)
+		unlink(tmp_name);
+	else
+		ret = 1;
+
+out_unmap:
+	if (data != NULL)
+		munmap(data, src_stat.st_size);
+out_close:
+	close(src_fd);
+out_free:
+	free(tmp_name);
+	free(dst_name);
+
+	return ret;
+}
+
+void compress_unlink(const char *filename) {
+	static const enum compress_method methods[] = {
+		compress_gzip,
+		compress_brotli,
+	};
+	char *name;
+	int i;
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (asprintf(&name, "%s%s", filename,
+					compress_suffix(methods[i])) < 0)
+			continue;
+		unlink(name);
+		free(name);
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * compress - write precompressed siblings of output files
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+enum compress_method {
+	compress_gzip = 1 << 0,
+	compress_brotli = 1 << 1,
+};
+
+#define COMPRESS_ALL (compress_gzip | compress_brotli)
+
+/* Parse a comma separated list of method names ("gzip", "br" or "all") into
+ * a mask of enum compress_method. Returns -1 on unknown names. */
+int compress_parse_methods(const char *list);
+
+/* Suffix appended to the source file name for the given method */
+const char *compress_suffix(enum compress_method method);
+
+/* Write <filename><suffix> unless it already exists with exactly the same
+ * mtime as filename. Siblings are given the mtime of the content they were
+ * made from, so any other mtime means that they are stale. Returns 1 if the
+ * sibling was (re)written, 0 if it was up to date and a negative errno on
+ * failure. */
+int compress_file(const char *filename, enum compress_method method);
+
+/* Remove all compressed siblings of filename */
+void compress_unlink(const char *filename);
+
+#endif /* _COMPRESS_H */
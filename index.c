@@ -0,0 +1,358 @@
+/*
+ * index - inverted index over the text of signs
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "index.h"
+#include "merge.h"
+#include "debug.h"
+
+#define FORMATTING_CODE 0xa7 /* Section sign, followed by a code character */
+
+void index_tokenize(const char *text,
+		void (*func)(const char *token, void *user_data),
+		void *user_data) {
+	GString *token = g_string_new(NULL);
+	gchar *lower;
+	const gchar *it;
+	gunichar c;
+	int utf8;
+
+	utf8 = g_utf8_validate(text, -1, NULL);
+	lower = utf8 ? g_utf8_strdown(text, -1) : g_ascii_strdown(text, -1);
+
+	for (it = lower; *it != 0; it = utf8 ? g_utf8_next_char(it) : it + 1) {
+		c = utf8 ? g_utf8_get_char(it) : (guchar)*it;
+
+		if (c == FORMATTING_CODE) {
+			/* Skip the code character as well */
+			if (utf8 && it[2] != 0)
+				it = g_utf8_next_char(it);
+			else if (!utf8 && it[1] != 0)
+				it++;
+			/* Codes may be in the middle of a word */
+			continue;
+		}
+		else if (utf8 ? g_unichar_isalnum(c) : g_ascii_isalnum(c)) {
+			if (utf8)
+				g_string_append_unichar(token, c);
+			else
+				g_string_append_c(token, c);
+			continue;
+		}
+
+		if (token->len > 0) {
+			func(token->str, user_data);
+			g_string_truncate(token, 0);
+		}
+	}
+
+	if (token->len > 0)
+		func(token->str, user_data);
+
+	g_string_free(token, TRUE);
+	g_free(lower);
+}
+
+static int compare_lines(const char *a, const char *b) {
+	return strcmp(a, b);
+}
+
+static void write_line(const char *line, void *user_data) {
+	FILE *fp = (FILE *)user_data;
+
+	if (fputs(line, fp) == EOF || fputc('\n', fp) == EOF) {
+		ERR("Error while writing index: %d", errno);
+		exit(1);
+	}
+}
+
+int index_rebuild(const char *path) {
+	GPtrArray *filenames;
+	GError *gerror = NULL;
+	struct run *runs;
+	const gchar *name;
+	char *filename, *tmp_filename;
+	unsigned int i, n = 0;
+	GDir *dir;
+	FILE *fp;
+	int ret = 0;
+
+	dir = g_dir_open(path, 0, &gerror);
+	if (dir == NULL) {
+		ERR("Unable to open %s: %s", path, gerror->message);
+		g_error_free(gerror);
+		return -EIO;
+	}
+
+	filenames = g_ptr_array_new();
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (g_str_has_suffix(name, INDEX_SUFFIX))
+			g_ptr_array_add(filenames,
+					g_strdup_printf("%s/%s", path, name));
+	}
+	g_dir_close(dir);
+
+	runs = calloc(filenames->len + 1, sizeof(struct run));
+	if (runs == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+	for (i = 0; i < filenames->len; i++) {
+		if (run_load(&runs[n], g_ptr_array_index(filenames, i)) == 0)
+			n++;
+		else
+			ERR("Unable to read %s",
+					(char *)g_ptr_array_index(filenames, i));
+	}
+
+	filename = g_strdup_printf("%s/%s", path, INDEX_FILENAME);
+	tmp_filename = g_strdup_printf("%s.tmp", filename);
+
+	fp = fopen(tmp_filename, "w");
+	if (fp == NULL) {
+		ERR("Unable to open index file %s: %d", tmp_filename, errno);
+		ret = -EIO;
+		goto out;
+	}
+
+	merge_runs(runs, n, compare_lines, 1, write_line, fp);
+
+	if (fclose(fp) || rename(tmp_filename, filename)) {
+		ERR("Error while writing index file %s: %d", filename, errno);
+		unlink(tmp_filename);
+		ret = -EIO;
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		run_free(&runs[i]);
+	free(runs);
+	for (i = 0; i < filenames->len; i++)
+		g_free(g_ptr_array_index(filenames, i));
+	g_ptr_array_free(filenames, TRUE);
+	g_free(tmp_filename);
+	g_free(filename);
+
+	return ret;
+}
+
+/* Compare the line starting at line with the first len bytes of key, as if
+ * the line was cut off after len bytes */
+static int compare_prefix(const char *line, const char *end, const char *key,
+		size_t len) {
+	const char *eol = memchr(line, '\n', end - line);
+	size_t line_len = (eol != NULL ? eol : end) - line;
+	int ret;
+
+	ret = memcmp(line, key, line_len < len ? line_len : len);
+	if (ret != 0)
+		return ret;
+
+	return line_len < len ? -1 : 0;
+}
+
+/* Binary search for the first line that is not less than key */
+static const char *find_first(const char *data, size_t size, const char *key,
+		size_t len) {
+	const char *end = data + size;
+	const char *lo = data, *hi = end;
+	const char *mid, *eol;
+
+	/* lo is always at the start of a line */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		while (mid > lo && mid[-1] != '\n')
+			mid--;
+
+		if (compare_prefix(mid, end, key, len) < 0) {
+			eol = memchr(mid, '\n', end - mid);
+			lo = eol != NULL ? eol + 1 : end;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Collect the positions of all signs with a token matching token, or
+ * starting with it if prefix is set */
+static GHashTable *lookup(const char *data, size_t size, const char *token,
+		int prefix) {
+	GHashTable *positions;
+	const char *end = data + size;
+	const char *it, *eol, *position;
+	gchar *key;
+	size_t len;
+
+	positions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			NULL);
+
+	/* Lines are "token<TAB>position", so an exact match includes the tab */
+	key = g_strdup_printf("%s%s", token, prefix ? "" : "\t");
+	len = strlen(key);
+
+	for (it = find_first(data, size, key, len); it < end; it = eol + 1) {
+		if (compare_prefix(it, end, key, len) != 0)
+			break;
+
+		eol = memchr(it, '\n', end - it);
+		if (eol == NULL)
+			eol = end;
+
+		/* The position is everything after the token */
+		position = memchr(it, '\t', eol - it);
+		if (position != NULL)
+			g_hash_table_add(positions,
+					g_strndup(position + 1,
+						eol - position - 1));
+	}
+
+	g_free(key);
+
+	return positions;
+}
+
+static void add_token(const char *token, void *user_data) {
+	g_ptr_array_add((GPtrArray *)user_data, g_strdup(token));
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+int index_query(const char *path, char **words, int n, FILE *out) {
+	GHashTable *matches = NULL, *positions;
+	GHashTableIter iter;
+	GPtrArray *tokens, *result;
+	gpointer position;
+	struct stat stat_buf;
+	char *filename;
+	char *data = NULL;
+	size_t len;
+	unsigned int i, prefix_start;
+	int fd, prefix;
+	int ret;
+
+	/* Normalize the words the same way as the sign text. Only the last
+	 * token of a word ending with '*' is a prefix. */
+	tokens = g_ptr_array_new();
+	prefix = -1;
+	for (i = 0; i < n; i++) {
+		len = strlen(words[i]);
+		prefix_start = tokens->len;
+		index_tokenize(words[i], add_token, tokens);
+		if (len > 0 && words[i][len - 1] == '*' &&
+				tokens->len > prefix_start) {
+			if (prefix >= 0) {
+				ERR0("Only one word may end with '*'");
+				ret = -EINVAL;
+				goto out_tokens;
+			}
+			prefix = tokens->len - 1;
+		}
+	}
+	if (tokens->len == 0) {
+		ret = 0;
+		goto out_tokens;
+	}
+
+	filename = g_strdup_printf("%s/%s", path, INDEX_FILENAME);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		ERR("Unable to open index file %s: %d", filename, errno);
+		g_free(filename);
+		goto out_tokens;
+	}
+	g_free(filename);
+
+	if (fstat(fd, &stat_buf)) {
+		ret = -errno;
+		close(fd);
+		goto out_tokens;
+	}
+	if (stat_buf.st_size > 0) {
+		data = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE,
+				fd, 0);
+		if (data == MAP_FAILED) {
+			ret = -errno;
+			close(fd);
+			goto out_tokens;
+		}
+	}
+	close(fd);
+
+	/* Intersect the signs of all tokens */
+	for (i = 0; i < tokens->len; i++) {
+		positions = lookup(data, stat_buf.st_size,
+				g_ptr_array_index(tokens, i), prefix == (int)i);
+		if (matches == NULL) {
+			matches = positions;
+			continue;
+		}
+
+		g_hash_table_iter_init(&iter, matches);
+		while (g_hash_table_iter_next(&iter, &position, NULL)) {
+			if (!g_hash_table_contains(positions, position))
+				g_hash_table_iter_remove(&iter);
+		}
+		g_hash_table_destroy(positions);
+
+		if (g_hash_table_size(matches) == 0)
+			break;
+	}
+
+	/* Print in index order, so that output is stable */
+	result = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, matches);
+	while (g_hash_table_iter_next(&iter, &position, NULL))
+		g_ptr_array_add(result, position);
+	g_ptr_array_sort(result, compare_strings);
+	for (i = 0; i < result->len; i++)
+		fprintf(out, "%s\n", (char *)g_ptr_array_index(result, i));
+
+	ret = result->len;
+	g_ptr_array_free(result, TRUE);
+	g_hash_table_destroy(matches);
+	if (data != NULL)
+		munmap(data, stat_buf.st_size);
+
+out_tokens:
+	for (i = 0; i < tokens->len; i++)
+		g_free(g_ptr_array_index(tokens, i));
+	g_ptr_array_free(tokens, TRUE);
+
+	return ret;
+}
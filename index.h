@@ -0,0 +1,49 @@
+/*
+ * index - inverted index over the text of signs
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stdio.h>
+
+/* The index is built from one sorted token file per region, each line being
+ * "token<TAB>dimension<TAB>x<TAB>y<TAB>z". These are merged into a single
+ * sorted file that can be binary searched. */
+#define INDEX_FILENAME "signs.index"
+#define INDEX_SUFFIX ".tokens"
+
+/* Call func for each token in text. Tokens are the lower case runs of
+ * letters and digits, with Minecraft formatting codes removed. */
+void index_tokenize(const char *text,
+		void (*func)(const char *token, void *user_data),
+		void *user_data);
+
+/* Merge all token files in path into path/INDEX_FILENAME. Returns 0 on
+ * success. */
+int index_rebuild(const char *path);
+
+/* Print the position of each sign in path/INDEX_FILENAME that contains all
+ * of the given words, one "dimension<TAB>x<TAB>y<TAB>z" per line. A word
+ * ending with '*' matches all tokens starting with the rest of it. Returns
+ * the number of signs found, or a negative errno. */
+int index_query(const char *path, char **words, int n, FILE *out);
+
+#endif /* _INDEX_H */
@@ -31,15 +31,28 @@
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <arpa/inet.h> /* For ntoh* */
+#include <zlib.h>
 
 #include "nbt.h"
 #include "debug.h"
 #include "region.h"
+#include "compress.h"
+#include "sign.h"
+#include "index.h"
+#include "merge.h"
+#include "probes.h"
 
 #define SIGN_TAG "#map"
 #define DEFAULT_OUTPUT_FORMAT "{ \"x\": \"%x\", \"y\": \"%y\", " \
 	"\"z\": \"%z\", \"msg\": \"%u %v %w (%x, %y, %z)\" },\n"
 char *opt_output_format = DEFAULT_OUTPUT_FORMAT;
+#define DEFAULT_EVENT_FORMAT "{ \"event\": \"%e\", \"x\": \"%x\", " \
+	"\"y\": \"%y\", \"z\": \"%z\", " \
+	"\"msg\": \"%u %v %w (%x, %y, %z)\" }\n"
+char *opt_event_format = DEFAULT_EVENT_FORMAT;
 #define OUTPUT_BUF_SIZE 1024 /* Write output in at most 1k-blocks */
 
 char *opt_output_path = NULL;
@@ -53,20 +66,117 @@ enum input_format {
 };
 enum input_format opt_input_format = white_space;
 
+int opt_compress = 0;
+int opt_compress_only = 0;
+
+struct bbox {
+	int set;
+	int32_t x1, y1, z1;
+	int32_t x2, y2, z2;
+};
+struct bbox opt_bbox = { 0 };
+
+char *opt_events_path = NULL;
+int opt_no_snapshot = 0;
+
+/* Events from all workers end up in the same file, one region at a time */
+FILE *events_fp = NULL;
+GMutex events_lock;
+
+int opt_survey = 0;
+
+/* Chunk sizes in the survey histogram are bucketed by powers of two sectors:
+ * 1, 2, 3-4, 5-8, ..., and everything above the last bucket */
+#define SURVEY_BUCKETS 8
+
+struct survey {
+	char *filename;
+	unsigned int chunks;
+	uint64_t bytes; /* Sector rounded size of all chunks */
+	uint32_t oldest, newest;
+	unsigned int histogram[SURVEY_BUCKETS];
+};
+
+/* Results of all surveyed regions, collected by the workers */
+GPtrArray *surveys = NULL;
+GMutex survey_lock;
+
+/* Only scan the regions of shard opt_shard out of opt_shards */
+unsigned int opt_shard = 0;
+unsigned int opt_shards = 0;
+char *opt_partial_path = NULL;
+
+/* Read chunks with pread and check them against the region header, for
+ * worlds that are being saved while scanned */
+int opt_live = 0;
+#define DEFAULT_LIVE_RETRIES 3
+unsigned int opt_live_retries = DEFAULT_LIVE_RETRIES;
+#define LIVE_RETRY_DELAY 100000 /* us before the first retry, then doubled */
+
+/* Merge the signs of all regions in the output path into one sorted file */
+char *opt_publish_path = NULL;
+char *opt_header = NULL;
+char *opt_footer = NULL;
+
+#define ETAG_SUFFIX ".etag"
+
+#define PARTIAL_MAGIC "#mcsign-partial"
+#define PARTIAL_VERSION 1
+#define STATE_SUFFIX ".state"
+
+int opt_index = 0;
+int opt_index_all = 0;
+
+/* Set by the workers when a token file changed, meaning that the index needs
+ * to be rebuilt. Only accessed with g_atomic_int_*. */
+gint index_dirty = 0;
+
 struct region_data {
 	char *filename;
-	FILE *fp;
-	int written;
+	int dimension;
+	GQueue *signs;
+	GQueue *other_signs; /* Non-matching signs, only with --index-all */
+	/* Inflated chunk data, reused for all chunks of the region */
+	unsigned char *chunk_buf;
+	size_t chunk_buf_size;
+	/* Region coordinates, used to find the chunk of a sign */
+	int rx, rz;
+	/* Chunks that could not be read, by index, or NULL if there were none.
+	 * The previous results are kept for the signs in them. */
+	unsigned char *skipped;
 };
 
+#define CHUNK_BUF_MIN_SIZE (64 * 1024)
+
 struct work {
 	char *filename;
+	/* Mask of enum compress_method, set when the work is to compress
+	 * filename rather than to scan it */
+	int compress;
 };
 
+static inline int in_range(nbt_node *node, const char *name, int32_t lo,
+		int32_t hi) {
+	nbt_node *coord = nbt_find_by_name(node, name);
+
+	return coord != NULL && coord->type == TAG_INT &&
+		coord->payload.tag_int >= lo && coord->payload.tag_int <= hi;
+}
+
+static int in_bbox(nbt_node *node) {
+	return in_range(node, "x", opt_bbox.x1, opt_bbox.x2) &&
+		in_range(node, "y", opt_bbox.y1, opt_bbox.y2) &&
+		in_range(node, "z", opt_bbox.z1, opt_bbox.z2);
+}
+
+static struct sign *node_to_sign(nbt_node *node, int dimension);
+
 bool cnbt_map_sign(nbt_node *node, void *aux) {
-	GQueue **queue = (GQueue **)aux;
+	struct region_data *rdata = (struct region_data *)aux;
 	nbt_node *id_node;
 	nbt_node *t1_node;
+	struct sign *sign;
+	GQueue *queue;
 	
 	/* Should be a compound */
 	if (node->type != TAG_COMPOUND)
@@ -82,128 +192,166 @@ bool cnbt_map_sign(nbt_node *node, void *aux) {
 	if (strcmp(id_node->payload.tag_string, "Sign") != 0)
 		return true;
 
-	/* Skip non-#map-signs */
+	/* Skip non-#map-signs, unless they are to be indexed */
 	t1_node = nbt_find_by_name(node, "Text1");
-	if (t1_node->type != TAG_STRING ||
-			strcmp(t1_node->payload.tag_string, SIGN_TAG) != 0)
+	if (t1_node == NULL || t1_node->type != TAG_STRING)
+		return true;
+	if (strcmp(t1_node->payload.tag_string, SIGN_TAG) == 0)
+		queue = rdata->signs;
+	else if (opt_index_all)
+		queue = rdata->other_signs;
+	else
+		return true;
+
+	/* Skip signs outside of the bounding box */
+	if (opt_bbox.set && !in_bbox(node))
 		return true;
 	
-	/* Add node to queue */
-	g_queue_push_head(*queue, node);
+	/* Add sign to queue */
+	sign = node_to_sign(node, rdata->dimension);
+	if (sign == NULL)
+		return true;
+	g_queue_push_head(queue, sign);
+	if (queue == rdata->signs)
+		PROBE4(sign__match, rdata->filename, sign->x, sign->y,
+				sign->z);
 
 	return true;
 }
 
+/* Find a node of the given type, or complain and return NULL */
 static inline nbt_node *safe_nbt_find_by_name(nbt_node *start_node,
-		const char *name) {
+		const char *name, nbt_type type) {
 	nbt_node *found_node;
 
 	found_node = nbt_find_by_name(start_node, name);
-	if (found_node == NULL) {
-		ERR("Internal error while searching for node %s.", name);
-		exit(1);
+	if (found_node == NULL || found_node->type != type) {
+		ERR("Skipping sign without a valid %s node", name);
+		return NULL;
 	}
 	
 	return found_node;
 }
 
-static inline void fetch_value_int(nbt_node *node, const char *name,
+static inline int fetch_value_int(nbt_node *node, const char *name,
 		const int32_t **dst) {
+	nbt_node *found_node;
+
 	if (*dst != NULL)
-		return;
+		return 0;
+
+	found_node = safe_nbt_find_by_name(node, name, TAG_INT);
+	if (found_node == NULL)
+		return -1;
+	*dst = &found_node->payload.tag_int;
 
-	*dst = &(safe_nbt_find_by_name(node, name)->payload.tag_int);
+	return 0;
 }
 
-static inline void fetch_value_str(nbt_node *node, const char *name,
+static inline int fetch_value_str(nbt_node *node, const char *name,
 		const char **dst) {
+	nbt_node *found_node;
 
 	if (*dst != NULL)
-		return;
+		return 0;
+
+	found_node = safe_nbt_find_by_name(node, name, TAG_STRING);
+	if (found_node == NULL)
+		return -1;
+	*dst = found_node->payload.tag_string;
+
+	return 0;
+}
+
+/* Build a sign from a sign tile entity node. Returns NULL if the node lacks
+ * any of the fields of a sign. */
+static struct sign *node_to_sign(nbt_node *node, int dimension) {
+	const char *text[SIGN_LINES] = { NULL };
+	const int32_t *x = NULL;
+	const int32_t *y = NULL;
+	const int32_t *z = NULL;
+	struct sign *sign;
+
+	if (fetch_value_int(node, "x", &x) ||
+			fetch_value_int(node, "y", &y) ||
+			fetch_value_int(node, "z", &z) ||
+			fetch_value_str(node, "Text1", &text[0]) ||
+			fetch_value_str(node, "Text2", &text[1]) ||
+			fetch_value_str(node, "Text3", &text[2]) ||
+			fetch_value_str(node, "Text4", &text[3]))
+		return NULL;
+
+	sign = sign_new(dimension, *x, *y, *z, text);
+	if (sign == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
 
-	*dst = safe_nbt_find_by_name(node, name)->payload.tag_string;
+	return sign;
 }
 
-size_t outf(FILE *fp, const char *format, nbt_node *node) {
+/* Format a sign according to format. event is what %e expands to, and may
+ * be NULL outside of event output. */
+size_t outf(FILE *fp, const char *format, const struct sign *sign,
+		const char *event) {
 	char buf[OUTPUT_BUF_SIZE];
 	int buf_left = OUTPUT_BUF_SIZE - 1;
 	size_t total = 0;
 	const char *fmt_it = format;
 	char *buf_it = buf;
+	const char *text;
 	int ret, handle_ret;
 
-	/* Caches */
-	const char *text1 = NULL;
-	const char *text2 = NULL;
-	const char *text3 = NULL;
-	const char *text4 = NULL;
-	const int32_t *x = NULL;
-	const int32_t *y = NULL;
-	const int32_t *z = NULL;
-
 	while (*fmt_it != 0) {
 		if (*fmt_it == '%') {
 			/* Format character */
 			fmt_it++;
 			handle_ret = 0;
+			text = NULL;
 			switch (*fmt_it) {
 			case 'x':
-				fetch_value_int(node, "x", &x);
-				ret = snprintf(buf_it, buf_left, "%d", *x);
+				ret = snprintf(buf_it, buf_left, "%d", sign->x);
 				handle_ret = 1;
 				break;
 			case 'y':
-				fetch_value_int(node, "y", &y);
-				ret = snprintf(buf_it, buf_left, "%d", *y);
+				ret = snprintf(buf_it, buf_left, "%d", sign->y);
 				handle_ret = 1;
 				break;
 			case 'z':
-				fetch_value_int(node, "z", &z);
-				ret = snprintf(buf_it, buf_left, "%d", *z);
+				ret = snprintf(buf_it, buf_left, "%d", sign->z);
 				handle_ret = 1;
 				break;
 			case 't':
-				fetch_value_str(node, "Text1", &text1);
-				if (*text1 != 0) {
-					ret = snprintf(buf_it, buf_left, "%s",
-							text1);
-					handle_ret = 1;
-				}
+				text = sign->text[0];
 				break;
 			case 'u':
-				fetch_value_str(node, "Text2", &text2);
-				if (*text2 != 0) {
-					ret = snprintf(buf_it, buf_left, "%s",
-							text2);
-					handle_ret = 1;
-				}
+				text = sign->text[1];
 				break;
 			case 'v':
-				fetch_value_str(node, "Text3", &text3);
-				if (*text3 != 0) {
-					ret = snprintf(buf_it, buf_left, "%s",
-							text3);
-					handle_ret = 1;
-				}
+				text = sign->text[2];
 				break;
 			case 'w':
-				fetch_value_str(node, "Text4", &text4);
-				if (*text4 != 0) {
-					ret = snprintf(buf_it, buf_left, "%s",
-							text4);
-					handle_ret = 1;
-				}
+				text = sign->text[3];
+				break;
+			case 'e':
+				text = event != NULL ? event : "";
 				break;
 			case '%':
 				*buf_it = '%';
 				buf_it++;
 				buf_left--;
+				break;
 			default:
 				ERR("Illegal format character: '%c'",
 						*fmt_it);
 				exit(1);
 			}
 
+			if (text != NULL && *text != 0) {
+				ret = snprintf(buf_it, buf_left, "%s", text);
+				handle_ret = 1;
+			}
+
 			if (handle_ret) {
 				if (ret < buf_left) {
 					buf_it += ret;
@@ -248,225 +396,1142 @@ size_t outf(FILE *fp, const char *format, nbt_node *node) {
 
 void queue_output(gpointer data, gpointer user_data) {
 	FILE *fp = (FILE *)user_data;
-	nbt_node *node = (nbt_node *)data;
+	struct sign *sign = (struct sign *)data;
 
-	outf(fp, opt_output_format, node);
+	outf(fp, opt_output_format, sign, NULL);
 
 	return;
 }
 
-void region_iterator(void *data, size_t len, void *user_data) {
+/* Inflate a zlib or gzip compressed chunk into rdata->chunk_buf, growing it
+ * as needed. Returns the inflated size, or -1 on error. The number of
+ * compressed bytes actually used is returned in consumed. */
+static ssize_t inflate_chunk(struct region_data *rdata, void *data,
+		size_t len, size_t *consumed) {
+	z_stream stream;
+	unsigned char *tmp;
+	int ret;
+
+	memset(&stream, 0, sizeof(stream));
+	/* 32 adds automatic detection of gzip or zlib headers */
+	if (inflateInit2(&stream, 15 + 32) != Z_OK)
+		return -1;
+
+	if (rdata->chunk_buf == NULL) {
+		rdata->chunk_buf = malloc(CHUNK_BUF_MIN_SIZE);
+		if (rdata->chunk_buf == NULL) {
+			perror("mcsign");
+			exit(1);
+		}
+		rdata->chunk_buf_size = CHUNK_BUF_MIN_SIZE;
+	}
+
+	stream.next_in = data;
+	stream.avail_in = len;
+	do {
+		if (stream.total_out == rdata->chunk_buf_size) {
+			tmp = realloc(rdata->chunk_buf,
+					rdata->chunk_buf_size * 2);
+			if (tmp == NULL) {
+				perror("mcsign");
+				exit(1);
+			}
+			rdata->chunk_buf = tmp;
+			rdata->chunk_buf_size *= 2;
+		}
+		stream.next_out = rdata->chunk_buf + stream.total_out;
+		stream.avail_out = rdata->chunk_buf_size - stream.total_out;
+		ret = inflate(&stream, Z_NO_FLUSH);
+	} while (ret == Z_OK);
+
+	*consumed = stream.total_in;
+	inflateEnd(&stream);
+
+	return ret == Z_STREAM_END ? (ssize_t)stream.total_out : -1;
+}
+
+/* Inflate and parse a chunk, adding its signs to the queues of rdata. Returns
+ * 0 on success and -1 if the chunk could not be inflated or parsed. */
+static int scan_chunk(struct region_data *rdata, unsigned int index,
+		void *data, size_t len) {
 	nbt_node *node_root, *node_levels, *node_te;
-	GQueue *queue;
-	FILE *fp;
-	struct region_data *rdata = (struct region_data*)user_data;
+	ssize_t inflated;
+	size_t consumed = 0;
+
+	PROBE3(chunk__start, rdata->filename, index, len);
 
 	/* == Parse data == */
-	node_root = nbt_parse_compressed(data, len);
+	inflated = inflate_chunk(rdata, data, len, &consumed);
+	if (inflated < 0) {
+		ERR("Error when inflating chunk %u for output %s",
+				index, rdata->filename);
+		PROBE5(chunk__end, rdata->filename, index, consumed, 0, 0);
+		return -1;
+	}
+	node_root = nbt_parse(rdata->chunk_buf, inflated);
 	if (node_root == NULL) {
-		ERR("Error when parsing for output %s at position %p: %d",
-				rdata->filename, user_data, errno);
-		return;
+		ERR("Error when parsing chunk %u for output %s: %d",
+				index, rdata->filename, errno);
+		PROBE5(chunk__end, rdata->filename, index, consumed,
+				inflated, 0);
+		return -1;
 	}
 
 	/* == Find signs and add them to the queue == */
 	node_levels = nbt_find_by_name(node_root, "Level");
 	if (node_levels == NULL || node_levels->type != TAG_COMPOUND) {
 		ERR0("Could not find Level node");
-		return;
+		goto out;
 	}
 	node_te = nbt_find_by_name(node_root, "TileEntities");
 	if (node_te == NULL || node_te->type != TAG_LIST) {
 		ERR0("Could not find TileEntities node");
-		return;
+		goto out;
 	}
 
-	queue = g_queue_new();
-	nbt_map(node_te, cnbt_map_sign, &queue);
+	nbt_map(node_te, cnbt_map_sign, rdata);
 
-	/* If list empty, remove any current files and go to next iteration */
-	if (g_queue_is_empty(queue))
-		goto out;
+out:
+	/* == Free all the data! == */
+	nbt_free(node_root);
+	PROBE5(chunk__end, rdata->filename, index, consumed, inflated, 1);
 
-	/* Open file descriptor if not opened already */
-	if (rdata->fp == NULL) {
-		fp = fopen(rdata->filename, "w");
-		if (fp == NULL) {
-			ERR("Unable to open output file %s: %d",
-					rdata->filename, errno);
+	return 0;
+}
+
+static void skip_chunk(struct region_data *rdata, unsigned int index) {
+	if (rdata->skipped == NULL) {
+		rdata->skipped = calloc(REGION_CHUNKS * REGION_CHUNKS, 1);
+		if (rdata->skipped == NULL) {
+			perror("mcsign");
 			exit(1);
 		}
-
-		rdata->fp = fp;
 	}
+	rdata->skipped[index] = 1;
+}
 
-	g_queue_foreach(queue, queue_output, fp);
+void region_iterator(unsigned int index, void *data, size_t len,
+		void *user_data) {
+	struct region_data *rdata = (struct region_data *)user_data;
 
-out:
-	/* == Free all the data! == */
-	g_queue_free(queue);
-	nbt_free(node_root);
+	if (scan_chunk(rdata, index, data, len))
+		skip_chunk(rdata, index);
 }
 
-void worker(gpointer data, gpointer user_data) {
-	GAsyncQueue *buffer_queue = (GAsyncQueue *) user_data;
-	struct work *work = (struct work *)data;
-	int len;
-	struct region_desc *region;
-	struct region_data rdata;
-	char *fn_iter;
-	char *filename;
+/* Signs found in one chunk during a live scan */
+struct live_chunk {
+	GQueue signs;
+	GQueue other_signs;
+};
 
-	DBG("worker: Got work: %p %s", work, work->filename);
-	/* === Open and iterate inside region == */
-	if (region_open(&region, work->filename)) {
-		ERR("Error while opening region file '%s'", work->filename);
-		return;
+static void live_chunk_clear(struct live_chunk *chunk) {
+	struct sign *sign;
+
+	while ((sign = g_queue_pop_head(&chunk->signs)) != NULL)
+		sign_free(sign);
+	while ((sign = g_queue_pop_head(&chunk->other_signs)) != NULL)
+		sign_free(sign);
+}
+
+/* Scan a region file that the server may be writing to. Chunks are read with
+ * pread and checked against the header, and the header is read again after
+ * each pass. Chunks that were inconsistent, could not be parsed or changed
+ * in the meantime are scanned again, at most opt_live_retries times. Chunks
+ * that are still bad after that, while the header stayed the same, are taken
+ * to be broken rather than being written, and are marked as skipped in rdata.
+ * Returns 0 on success and -EAGAIN if the region never settled, in which case
+ * rdata holds no signs. */
+static int scan_live(struct region_desc *region, struct region_data *rdata) {
+	unsigned char pending[REGION_CHUNKS * REGION_CHUNKS];
+	unsigned char changed[REGION_CHUNKS * REGION_CHUNKS];
+	GQueue *signs = rdata->signs;
+	GQueue *other_signs = rdata->other_signs;
+	struct live_chunk *chunks;
+	unsigned char *buf = NULL, *data;
+	size_t buf_size = 0, len;
+	unsigned int index, left, moved, attempt = 0;
+	size_t file_pos, data_size;
+	gulong delay = LIVE_RETRY_DELAY;
+	int ret, settled;
+
+	chunks = calloc(REGION_CHUNKS * REGION_CHUNKS,
+			sizeof(struct live_chunk));
+	if (chunks == NULL) {
+		perror("mcsign");
+		exit(1);
 	}
 
-	/* === Build the destination file name === */
+	memset(pending, 1, sizeof(pending));
+	while (1) {
+		left = 0;
+		for (index = 0; index < REGION_CHUNKS * REGION_CHUNKS;
+				index++) {
+			if (!pending[index])
+				continue;
+			pending[index] = 0;
+
+			/* Forget what an earlier pass found in the chunk */
+			live_chunk_clear(&chunks[index]);
+			if (rdata->skipped != NULL)
+				rdata->skipped[index] = 0;
+
+			ret = region_read_chunk(region, index, &buf,
+					&buf_size, &data, &len);
+			if (ret == 1)
+				continue;
+			if (ret == -ENOMEM) {
+				perror("mcsign");
+				exit(1);
+			}
+			if (ret < 0 && ret != -EAGAIN) {
+				ERR("Skipping chunk %u for output %s: %d",
+						index, rdata->filename, -ret);
+				skip_chunk(rdata, index);
+				continue;
+			}
 
-	/* Find the base name of the file (file name w/o path) */
-	fn_iter = &work->filename[strlen(work->filename) - 1];
-	while (*fn_iter != '/' && fn_iter != work->filename)
-		fn_iter--;
+			rdata->signs = &chunks[index].signs;
+			rdata->other_signs = other_signs != NULL ?
+				&chunks[index].other_signs : NULL;
+			if (ret == -EAGAIN ||
+					scan_chunk(rdata, index, data, len)) {
+				pending[index] = 1;
+				left++;
+			}
+		}
 
-	/* Construct the target file name */
-	len = asprintf(&filename, "%s/%s.sign", opt_output_path,
-			fn_iter);
-	if (len < 0)
-		return;
+		ret = region_reread_header(region, changed);
+		if (ret < 0) {
+			ERR("Unable to read the header of %s again: %d",
+					rdata->filename, -ret);
+			settled = 0;
+			break;
+		}
+		moved = 0;
+		for (index = 0; index < REGION_CHUNKS * REGION_CHUNKS;
+				index++) {
+			if (!changed[index])
+				continue;
+
+			/* Changes outside of --bbox are none of our business,
+			 * and a chunk that was removed has nothing to read */
+			if (!region_chunk_location(region, index, &file_pos,
+						&data_size)) {
+				live_chunk_clear(&chunks[index]);
+				if (rdata->skipped != NULL)
+					rdata->skipped[index] = 0;
+				if (pending[index]) {
+					pending[index] = 0;
+					left--;
+				}
+				continue;
+			}
 
-	rdata.filename = filename;
-	rdata.fp = NULL;
+			moved++;
+			if (!pending[index]) {
+				pending[index] = 1;
+				left++;
+			}
+		}
 
-	/* Return the buffer */
-	free(work->filename);
-	work->filename = NULL;
-	g_async_queue_push(buffer_queue, work);
+		/* If nothing moved during the last pass, what is still bad
+		 * will stay that way */
+		if (left == 0 || attempt == opt_live_retries) {
+			settled = left == 0 || moved == 0;
+			break;
+		}
 
-	foreach_part_in_region(region, region_iterator, &rdata);
+		DBG("live: rescanning %u chunks for output %s", left,
+				rdata->filename);
+		g_usleep(delay);
+		delay *= 2;
+		attempt++;
+	}
 
-	/* Remove file if nothing was found in the region file */
-	if (rdata.fp == NULL)
-		unlink(filename);
-	else
-		fclose(rdata.fp);
+	if (left > 0 && settled) {
+		ERR("Skipping %u broken chunks for output %s", left,
+				rdata->filename);
+		for (index = 0; index < REGION_CHUNKS * REGION_CHUNKS;
+				index++)
+			if (pending[index])
+				skip_chunk(rdata, index);
+	}
 
-	free(filename);
-	region_close(region);
+	rdata->signs = signs;
+	rdata->other_signs = other_signs;
+	for (index = 0; index < REGION_CHUNKS * REGION_CHUNKS; index++) {
+		if (settled) {
+			while (!g_queue_is_empty(&chunks[index].signs))
+				g_queue_push_tail(signs, g_queue_pop_head(
+							&chunks[index].signs));
+			while (!g_queue_is_empty(&chunks[index].other_signs))
+				g_queue_push_tail(other_signs,
+						g_queue_pop_head(
+							&chunks[index].other_signs));
+		}
+		live_chunk_clear(&chunks[index]);
+	}
+	free(chunks);
+	free(buf);
+
+	return settled ? 0 : -EAGAIN;
 }
 
-struct input_context {
-	char *buffer;
-	int bsize;
-	int bpos;
-};
+/* Move tmp_filename over filename if the contents differ, otherwise remove
+ * tmp_filename and leave filename (and its mtime) untouched. Returns 1 if
+ * filename was replaced and 0 if it was not. */
+static int replace_if_changed(const char *tmp_filename, const char *filename) {
+	char tmp_buf[4096], buf[4096];
+	FILE *tmp_fp, *fp;
+	size_t tmp_len, len;
+	int equal = 0;
+
+	tmp_fp = fopen(tmp_filename, "r");
+	fp = fopen(filename, "r");
+	if (tmp_fp != NULL && fp != NULL) {
+		do {
+			tmp_len = fread(tmp_buf, 1, sizeof(tmp_buf), tmp_fp);
+			len = fread(buf, 1, sizeof(buf), fp);
+			equal = tmp_len == len &&
+				memcmp(tmp_buf, buf, len) == 0;
+		} while (equal && len > 0);
+	}
+	if (tmp_fp != NULL)
+		fclose(tmp_fp);
+	if (fp != NULL)
+		fclose(fp);
+
+	PROBE2(output__flush, filename, !equal);
+	if (equal) {
+		unlink(tmp_filename);
+		return 0;
+	}
 
-void init_input_context(struct input_context *ic) {
-	ic->buffer = malloc(1024);
-	if (ic->buffer == NULL) {
-		perror("mcsign");
+	if (rename(tmp_filename, filename)) {
+		ERR("Unable to rename %s to %s: %d", tmp_filename, filename,
+				errno);
 		exit(1);
 	}
-	ic->bsize = 1024;
-	ic->bpos = 0;
+
+	return 1;
 }
 
-int static inline does_match(char c) {
-	switch (c) {
-	case '\t':
-	case '\n':
-	case '\r':
-	case ' ':
-		if (opt_input_format == white_space)
-			return 1;
-		break;
+/* Write the compressed siblings of filename for all requested methods */
+static void compress_output(const char *filename, int methods) {
+	enum compress_method method;
+	int ret;
 
-	case 0:
-		if (opt_input_format == null)
-			return 1;
-		break;
-	}
+	for (method = compress_gzip; method <= compress_brotli; method <<= 1) {
+		if (!(methods & method))
+			continue;
 
-	return 0;
+		ret = compress_file(filename, method);
+		if (ret < 0)
+			ERR("Error while compressing %s: %d", filename, -ret);
+	}
 }
 
-char *get_input(struct input_context *ic) {
-	ssize_t r;
-	char *tmp;
-	int i, start_position;
+/* Write the signs of a region to filename in the output format, removing it
+ * if there are none */
+static void write_snapshot(const char *filename, GQueue *signs) {
+	char *tmp_filename;
+	FILE *fp;
 
-	/* Real EOF indication */
-	if (ic->buffer == NULL)
-		return NULL;
-	
-	while (1) {
-		/* Skip past any matched delimiter-characters in the beginning
-		 * of the buffer */
-		i = 0;
-		while (i < ic->bpos && does_match(ic->buffer[i]))
-			i++;
+	if (g_queue_is_empty(signs)) {
+		unlink(filename);
+		compress_unlink(filename);
+		return;
+	}
 
-		/* Record start and search for next delimiter */
-		start_position = i;
-		while (i < ic->bpos && !does_match(ic->buffer[i]))
-			i++;
+	if (asprintf(&tmp_filename, "%s.tmp", filename) < 0) {
+		perror("mcsign");
+		exit(1);
+	}
 
-		/* Do we have a match? */
-		if (i <= ic->bpos && does_match(ic->buffer[i])
-					&& i != start_position) {
-			ic->buffer[i] = 0;
+	fp = fopen(tmp_filename, "w");
+	if (fp == NULL) {
+		ERR("Unable to open output file %s: %d", tmp_filename, errno);
+		exit(1);
+	}
+	g_queue_foreach(signs, queue_output, fp);
+	if (fclose(fp)) {
+		ERR("Error while writing to file: %d", errno);
+		exit(1);
+	}
 
-			tmp = strdup(&ic->buffer[start_position]);
+	/* Siblings are only rewritten if the output changed */
+	replace_if_changed(tmp_filename, filename);
+	compress_output(filename, opt_compress);
 
-			/* Increment i, as it is now pointing to the end of
-			 * the previous delimited substring */
-			i++;
-			/* Anything worth saving? */
-			if (i < ic->bpos)
-				memmove(ic->buffer, &ic->buffer[i],
-						ic->bpos - i);
-			ic->bpos -= i;
+	free(tmp_filename);
+}
 
-			return tmp;
-		}
+/* Read the signs found in a region during the previous run. The returned
+ * table is keyed on sign position and owns its keys. */
+static GHashTable *load_state(const char *filename) {
+	GHashTable *state;
+	struct sign *sign;
+	FILE *fp;
+	int error;
 
-		/* Do a read */
-		r = read(STDIN_FILENO, &ic->buffer[ic->bpos],
-				ic->bsize - ic->bpos);
-		ic->bpos += r;
-		/* Handle EOF */
-		if (r == 0) {
-			free(ic->buffer);
-			ic->buffer = NULL;
-			return NULL;
-		}
+	state = g_hash_table_new_full(sign_hash, (GEqualFunc)sign_key_equal,
+			(GDestroyNotify)sign_free, NULL);
 
-		/* Grow buffer if we hit the ceiling */
-		if (ic->bpos == ic->bsize) {
-			ic->buffer = realloc(ic->buffer, ic->bsize * 2);
-			if (ic->buffer == NULL) {
-				perror("mcsign");
-				exit(1);
-			}
-			ic->bsize *= 2;
-		}
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+		return state;
 
-	}
+	while ((sign = sign_read(fp, &error)) != NULL)
+		g_hash_table_replace(state, sign, sign);
+	if (error)
+		ERR("Ignoring the rest of malformed state file %s", filename);
+
+	fclose(fp);
 
+	return state;
 }
 
-void print_help(void) {
-	ERR0("Usage: mcsign [ OPTIONS ]");
-	ERR0("Fetches sign data from Minecraft region files and outputs data to one file");
-	ERR0("per region file read.");
-	ERR0("");
-	ERR0("Mandatory arguments to long options are mandatory for short options too.");
-	ERR0("  -0, --null               data on standard is terminated by a null characted");
-	ERR0("                           (like find -print0 and xargs -0");
-	ERR0("  -f, --format=FORMAT      specify how the output is to be formatted. If this");
-	ERR0("                           argument is not specified, the default format will");
+static gint queue_sign_compare(gconstpointer a, gconstpointer b,
+		gpointer user_data) {
+	return sign_compare(a, b);
+}
+
+/* Write the current signs of a region to its state file, for the next run to
+ * compare against. The signs are expected to be sorted, so that the file can
+ * be merged into a partial or published result. */
+static void save_state(const char *filename, GQueue *signs) {
+	char *tmp_filename;
+	GList *it;
+	FILE *fp;
+
+	if (g_queue_is_empty(signs)) {
+		unlink(filename);
+		return;
+	}
+
+	if (asprintf(&tmp_filename, "%s.tmp", filename) < 0) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	fp = fopen(tmp_filename, "w");
+	if (fp == NULL) {
+		ERR("Unable to open state file %s: %d", tmp_filename, errno);
+		exit(1);
+	}
+	for (it = signs->head; it != NULL; it = it->next) {
+		if (sign_write(fp, it->data)) {
+			ERR("Error while writing to file: %d", errno);
+			exit(1);
+		}
+	}
+	if (fclose(fp) || rename(tmp_filename, filename)) {
+		ERR("Error while writing state file %s: %d", filename, errno);
+		exit(1);
+	}
+	PROBE2(output__flush, filename, 1);
+
+	free(tmp_filename);
+}
+
+/* Division rounding towards negative infinity, for block -> chunk/region */
+static inline int floor_div(int32_t a, int32_t b) {
+	return a >= 0 ? a / b : -((-(int64_t)a + b - 1) / b);
+}
+
+static int sign_in_bbox(const struct sign *sign) {
+	return sign->x >= opt_bbox.x1 && sign->x <= opt_bbox.x2 &&
+		sign->y >= opt_bbox.y1 && sign->y <= opt_bbox.y2 &&
+		sign->z >= opt_bbox.z1 && sign->z <= opt_bbox.z2;
+}
+
+/* Whether sign was not looked for in this run, being outside of the bounding
+ * box or in a chunk that was skipped, so that its previous results stand */
+static int sign_not_scanned(const struct region_data *rdata,
+		const struct sign *sign) {
+	int cx, cz;
+
+	if (opt_bbox.set && !sign_in_bbox(sign))
+		return 1;
+	if (rdata->skipped == NULL)
+		return 0;
+
+	cx = floor_div(sign->x, CHUNK_BLOCKS) - rdata->rx * REGION_CHUNKS;
+	cz = floor_div(sign->z, CHUNK_BLOCKS) - rdata->rz * REGION_CHUNKS;
+	if (cx < 0 || cx >= REGION_CHUNKS || cz < 0 || cz >= REGION_CHUNKS)
+		return 0;
+
+	return rdata->skipped[cx + cz * REGION_CHUNKS];
+}
+
+/* Compare the signs of a region against the previous run, write add, remove
+ * and modify events for the differences and save the new state. Signs of the
+ * previous run outside of the bounding box or in skipped chunks were never
+ * looked for, so they are kept and added to signs (which stays sorted). */
+static void update_state(const char *filename, struct region_data *rdata) {
+	GQueue *signs = rdata->signs;
+	GHashTable *previous;
+	GHashTableIter iter;
+	GQueue removed;
+	struct sign *sign, *old;
+	char *events = NULL;
+	size_t events_size = 0;
+	FILE *fp = NULL;
+	GList *it;
+
+	previous = load_state(filename);
+
+	/* Format the events of this region in memory, so that they can be
+	 * written in one go without interleaving with other workers */
+	if (events_fp != NULL) {
+		fp = open_memstream(&events, &events_size);
+		if (fp == NULL) {
+			perror("mcsign");
+			exit(1);
+		}
+	}
+
+	for (it = signs->head; it != NULL; it = it->next) {
+		sign = it->data;
+		old = g_hash_table_lookup(previous, sign);
+		if (old == NULL) {
+			if (fp != NULL)
+				outf(fp, opt_event_format, sign, "add");
+			continue;
+		}
+
+		if (fp != NULL && sign_text_compare(sign, old) != 0)
+			outf(fp, opt_event_format, sign, "modify");
+		g_hash_table_remove(previous, old);
+	}
+
+	if (opt_bbox.set || rdata->skipped != NULL) {
+		g_hash_table_iter_init(&iter, previous);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&old, NULL)) {
+			if (!sign_not_scanned(rdata, old))
+				continue;
+			g_hash_table_iter_steal(&iter);
+			g_queue_push_tail(signs, old);
+		}
+		g_queue_sort(signs, queue_sign_compare, NULL);
+	}
+
+	/* Whatever is left is gone since the last run. Output it in the same
+	 * order as everything else. */
+	if (fp != NULL) {
+		g_queue_init(&removed);
+		g_hash_table_iter_init(&iter, previous);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&old, NULL))
+			g_queue_push_tail(&removed, old);
+		g_queue_sort(&removed, queue_sign_compare, NULL);
+		for (it = removed.head; it != NULL; it = it->next)
+			outf(fp, opt_event_format, it->data, "remove");
+		g_queue_clear(&removed);
+
+		fclose(fp);
+		if (events_size > 0) {
+			g_mutex_lock(&events_lock);
+			if (fwrite(events, 1, events_size, events_fp) !=
+					events_size) {
+				ERR("Error while writing events: %d", errno);
+				exit(1);
+			}
+			g_mutex_unlock(&events_lock);
+			PROBE1(events__flush, events_size);
+		}
+		free(events);
+	}
+
+	g_hash_table_destroy(previous);
+
+	save_state(filename, signs);
+}
+
+struct token_context {
+	GPtrArray *lines;
+	const struct sign *sign;
+};
+
+static void add_token_line(const char *token, void *user_data) {
+	struct token_context *context = (struct token_context *)user_data;
+	const struct sign *sign = context->sign;
+
+	g_ptr_array_add(context->lines, g_strdup_printf("%s\t%d\t%d\t%d\t%d",
+				token, sign->dimension, sign->x, sign->y,
+				sign->z));
+}
+
+static void add_sign_tokens(GQueue *signs, struct token_context *context) {
+	GList *it;
+	int i;
+
+	for (it = signs->head; it != NULL; it = it->next) {
+		context->sign = it->data;
+		for (i = 0; i < SIGN_LINES; i++)
+			index_tokenize(context->sign->text[i], add_token_line,
+					context);
+	}
+}
+
+/* Keep the token lines of the previous run for signs that were not looked
+ * for, as update_state does. Signs with #map are carried over by update_state
+ * already, which leaves those without (--index-all). */
+static void add_previous_tokens(const char *filename,
+		const struct region_data *rdata, GPtrArray *lines) {
+	int32_t dimension, x, y, z;
+	struct sign position;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+		return;
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = 0;
+		if (sscanf(line, "%*[^\t]\t%d\t%d\t%d\t%d", &dimension, &x, &y,
+					&z) != 4)
+			continue;
+
+		position.x = x;
+		position.y = y;
+		position.z = z;
+		if (sign_not_scanned(rdata, &position))
+			g_ptr_array_add(lines, g_strdup(line));
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+static gint compare_lines(gconstpointer a, gconstpointer b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* Write the sorted token file of a region, for index_rebuild to merge */
+static void write_tokens(const char *filename, struct region_data *rdata) {
+	struct token_context context;
+	char *tmp_filename;
+	const char *line, *last = NULL;
+	unsigned int i;
+	FILE *fp;
+
+	context.lines = g_ptr_array_new();
+	add_sign_tokens(rdata->signs, &context);
+	if (rdata->other_signs != NULL)
+		add_sign_tokens(rdata->other_signs, &context);
+	if (opt_bbox.set || rdata->skipped != NULL)
+		add_previous_tokens(filename, rdata, context.lines);
+
+	if (context.lines->len == 0) {
+		if (unlink(filename) == 0)
+			g_atomic_int_set(&index_dirty, 1);
+		g_ptr_array_free(context.lines, TRUE);
+		return;
+	}
+
+	if (asprintf(&tmp_filename, "%s.tmp", filename) < 0) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	fp = fopen(tmp_filename, "w");
+	if (fp == NULL) {
+		ERR("Unable to open token file %s: %d", tmp_filename, errno);
+		exit(1);
+	}
+
+	g_ptr_array_sort(context.lines, compare_lines);
+	for (i = 0; i < context.lines->len; i++) {
+		line = g_ptr_array_index(context.lines, i);
+		/* A word repeated on a sign only needs to be indexed once */
+		if (last == NULL || strcmp(last, line) != 0) {
+			if (fprintf(fp, "%s\n", line) < 0) {
+				ERR("Error while writing to file: %d", errno);
+				exit(1);
+			}
+		}
+		last = line;
+	}
+	if (fclose(fp)) {
+		ERR("Error while writing to file: %d", errno);
+		exit(1);
+	}
+
+	if (replace_if_changed(tmp_filename, filename))
+		g_atomic_int_set(&index_dirty, 1);
+
+	for (i = 0; i < context.lines->len; i++)
+		g_free(g_ptr_array_index(context.lines, i));
+	g_ptr_array_free(context.lines, TRUE);
+	free(tmp_filename);
+}
+
+/* The name that the output files of a region are based on: the base name of
+ * the region file, prefixed with DIM<n>. outside of the overworld, so that
+ * regions with the same name in different dimensions are kept apart */
+static char *region_output_name(const char *filename, int dimension) {
+	const char *basename;
+	char *name;
+
+	basename = strrchr(filename, '/');
+	basename = basename == NULL ? filename : basename + 1;
+
+	if (dimension == 0)
+		name = strdup(basename);
+	else if (asprintf(&name, "DIM%d.%s", dimension, basename) < 0)
+		name = NULL;
+	if (name == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	return name;
+}
+
+/* The shard a region belongs to, from a hash of its dimension and coordinates
+ * that is the same on all hosts. name is a region_output_name. Names that are
+ * not on the r.X.Z form are hashed as they are. */
+static unsigned int shard_of(const char *name) {
+	const char *it;
+	uint32_t hash;
+	int dimension = 0, rx, rz, n = 0;
+
+	if (sscanf(name, "DIM%d.%n", &dimension, &n) != 1 || n == 0)
+		dimension = 0;
+
+	if (region_coords_from_filename(&name[n], &rx, &rz) == 0) {
+		hash = (uint32_t)rx * 0x9e3779b1u ^ (uint32_t)rz * 0x85ebca77u;
+		hash ^= (uint32_t)dimension * 0xc2b2ae35u;
+		hash ^= hash >> 15;
+		hash *= 0x2c1b3c6du;
+		hash ^= hash >> 12;
+	}
+	else {
+		for (it = name, hash = 2166136261u; *it != 0; it++)
+			hash = (hash ^ (unsigned char)*it) * 16777619u;
+	}
+
+	return hash % opt_shards;
+}
+
+/* Restrict the chunks visited in region (at region coordinates rx, rz) to
+ * those overlapping the bounding box */
+static void restrict_to_bbox(struct region_desc *region, int rx, int rz) {
+	region_restrict(region,
+			floor_div(opt_bbox.x1, CHUNK_BLOCKS) - rx * REGION_CHUNKS,
+			floor_div(opt_bbox.z1, CHUNK_BLOCKS) - rz * REGION_CHUNKS,
+			floor_div(opt_bbox.x2, CHUNK_BLOCKS) - rx * REGION_CHUNKS,
+			floor_div(opt_bbox.z2, CHUNK_BLOCKS) - rz * REGION_CHUNKS);
+}
+
+static inline int survey_bucket(size_t sectors) {
+	int bucket = 0;
+
+	while (bucket < SURVEY_BUCKETS - 1 && ((size_t)1 << bucket) < sectors)
+		bucket++;
+
+	return bucket;
+}
+
+/* Collect statistics of a region from its header only */
+static void survey_region(const char *filename, int has_coords, int rx,
+		int rz) {
+	struct region_desc *region;
+	struct survey *survey;
+	size_t file_pos, data_size;
+	uint32_t timestamp;
+	unsigned int i;
+
+	if (region_open_header(&region, filename)) {
+		ERR("Error while opening region file '%s'", filename);
+		return;
+	}
+	if (opt_bbox.set && has_coords)
+		restrict_to_bbox(region, rx, rz);
+
+	survey = calloc(1, sizeof(struct survey));
+	if (survey == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+	survey->filename = strdup(filename);
+	survey->oldest = UINT32_MAX;
+
+	for (i = 0; i < REGION_CHUNKS * REGION_CHUNKS; i++) {
+		if (!region_chunk_location(region, i, &file_pos, &data_size))
+			continue;
+
+		timestamp = ntohl(region->timestamps[i]);
+		survey->chunks++;
+		survey->bytes += data_size;
+		survey->histogram[survey_bucket(data_size / 4096)]++;
+		if (timestamp < survey->oldest)
+			survey->oldest = timestamp;
+		if (timestamp > survey->newest)
+			survey->newest = timestamp;
+	}
+
+	region_close(region);
+
+	g_mutex_lock(&survey_lock);
+	g_ptr_array_add(surveys, survey);
+	g_mutex_unlock(&survey_lock);
+}
+
+/* Largest first, so that the output can be used to order the real run */
+static gint survey_compare(gconstpointer a, gconstpointer b) {
+	const struct survey *sa = *(const struct survey **)a;
+	const struct survey *sb = *(const struct survey **)b;
+
+	if (sa->bytes != sb->bytes)
+		return sa->bytes < sb->bytes ? 1 : -1;
+
+	return strcmp(sa->filename, sb->filename);
+}
+
+static void format_time(char *buf, size_t len, uint32_t timestamp) {
+	time_t t = timestamp;
+	struct tm tm;
+
+	if (gmtime_r(&t, &tm) == NULL ||
+			strftime(buf, len, "%Y-%m-%d %H:%M:%S UTC", &tm) == 0)
+		snprintf(buf, len, "%u", timestamp);
+}
+
+/* Print one line per region, largest first, followed by totals for the
+ * whole world as comments */
+static void print_survey(void) {
+	struct survey total = { 0 };
+	struct survey *survey;
+	unsigned int regions = 0;
+	char oldest[32], newest[32];
+	char label[16];
+	unsigned int i, j;
+
+	total.oldest = UINT32_MAX;
+	g_ptr_array_sort(surveys, survey_compare);
+
+	printf("# bytes\tchunks\toldest\tnewest\tregion\n");
+	for (i = 0; i < surveys->len; i++) {
+		survey = g_ptr_array_index(surveys, i);
+		if (survey->chunks == 0)
+			continue;
+
+		printf("%" PRIu64 "\t%u\t%u\t%u\t%s\n", survey->bytes,
+				survey->chunks, survey->oldest, survey->newest,
+				survey->filename);
+
+		regions++;
+		total.chunks += survey->chunks;
+		total.bytes += survey->bytes;
+		for (j = 0; j < SURVEY_BUCKETS; j++)
+			total.histogram[j] += survey->histogram[j];
+		if (survey->oldest < total.oldest)
+			total.oldest = survey->oldest;
+		if (survey->newest > total.newest)
+			total.newest = survey->newest;
+	}
+
+	printf("# regions: %u (%u without chunks)\n", regions,
+			surveys->len - regions);
+	printf("# chunks: %u, %.1f per region\n", total.chunks,
+			regions > 0 ? (double)total.chunks / regions : 0.0);
+	if (total.chunks > 0) {
+		format_time(oldest, sizeof(oldest), total.oldest);
+		format_time(newest, sizeof(newest), total.newest);
+		printf("# oldest chunk: %s\n", oldest);
+		printf("# newest chunk: %s\n", newest);
+	}
+	printf("# chunk sizes (4 KiB sectors):\n");
+	for (j = 0; j < SURVEY_BUCKETS; j++) {
+		if (j == SURVEY_BUCKETS - 1)
+			snprintf(label, sizeof(label), ">%u", 1u << (j - 1));
+		else if (j < 2)
+			snprintf(label, sizeof(label), "%u", 1u << j);
+		else
+			snprintf(label, sizeof(label), "%u-%u",
+					(1u << (j - 1)) + 1, 1u << j);
+		printf("#   %-8s%u\n", label, total.histogram[j]);
+	}
+	printf("# full scan: %u chunks to inflate from at most %" PRIu64
+			" bytes (%.1f MiB)\n", total.chunks, total.bytes,
+			total.bytes / (1024.0 * 1024.0));
+}
+
+void worker(gpointer data, gpointer user_data) {
+	GAsyncQueue *buffer_queue = (GAsyncQueue *) user_data;
+	struct work *work = (struct work *)data;
+	int len;
+	struct region_desc *region;
+	struct region_data rdata;
+	char *name;
+	char *filename;
+	char *state_filename;
+	char *tokens_filename;
+	int has_coords, rx, rz;
+	int ret;
+
+	DBG("worker: Got work: %p %s", work, work->filename);
+
+	if (work->compress != 0) {
+		compress_output(work->filename, work->compress);
+
+		free(work->filename);
+		work->filename = NULL;
+		g_async_queue_push(buffer_queue, work);
+		return;
+	}
+
+	/* === Skip regions outside of the bounding box === */
+	has_coords = region_coords_from_filename(work->filename, &rx, &rz) == 0;
+	if (opt_bbox.set && has_coords &&
+			(floor_div(opt_bbox.x2, REGION_BLOCKS) < rx ||
+			 floor_div(opt_bbox.x1, REGION_BLOCKS) > rx ||
+			 floor_div(opt_bbox.z2, REGION_BLOCKS) < rz ||
+			 floor_div(opt_bbox.z1, REGION_BLOCKS) > rz)) {
+		DBG("worker: %s is outside of the bounding box",
+				work->filename);
+		free(work->filename);
+		work->filename = NULL;
+		g_async_queue_push(buffer_queue, work);
+		return;
+	}
+
+	/* === Skip regions belonging to other shards === */
+	rdata.dimension = region_dimension_from_filename(work->filename);
+	name = region_output_name(work->filename, rdata.dimension);
+	if (opt_shards > 0 && shard_of(name) != opt_shard) {
+		DBG("worker: %s belongs to another shard", work->filename);
+		free(name);
+		free(work->filename);
+		work->filename = NULL;
+		g_async_queue_push(buffer_queue, work);
+		return;
+	}
+
+	if (opt_survey) {
+		survey_region(work->filename, has_coords, rx, rz);
+
+		free(name);
+		free(work->filename);
+		work->filename = NULL;
+		g_async_queue_push(buffer_queue, work);
+		return;
+	}
+
+	/* === Open and iterate inside region == */
+	/* A live region file may shrink while mapped, which would SIGBUS */
+	if ((opt_live ? region_open_header : region_open)(&region,
+				work->filename)) {
+		ERR("Error while opening region file '%s'", work->filename);
+		free(name);
+		free(work->filename);
+		work->filename = NULL;
+		g_async_queue_push(buffer_queue, work);
+		return;
+	}
+
+	/* Only inflate the chunks that overlap the bounding box */
+	if (opt_bbox.set && has_coords)
+		restrict_to_bbox(region, rx, rz);
+
+	/* === Build the destination file names === */
+	len = asprintf(&filename, "%s/%s.sign", opt_output_path, name);
+	if (len < 0) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	len = asprintf(&state_filename, "%s/%s%s", opt_output_path, name,
+			STATE_SUFFIX);
+	if (len < 0) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	len = asprintf(&tokens_filename, "%s/%s%s", opt_output_path, name,
+			INDEX_SUFFIX);
+	if (len < 0) {
+		perror("mcsign");
+		exit(1);
+	}
+	free(name);
+
+	rdata.filename = filename;
+	rdata.signs = g_queue_new();
+	rdata.other_signs = opt_index_all ? g_queue_new() : NULL;
+	rdata.chunk_buf = NULL;
+	rdata.chunk_buf_size = 0;
+	rdata.rx = has_coords ? rx : 0;
+	rdata.rz = has_coords ? rz : 0;
+	rdata.skipped = NULL;
+
+	/* Return the buffer */
+	free(work->filename);
+	work->filename = NULL;
+	g_async_queue_push(buffer_queue, work);
+
+	if (opt_live) {
+		ret = scan_live(region, &rdata);
+	}
+	else {
+		foreach_part_in_region(region, region_iterator, &rdata);
+		ret = 0;
+	}
+	free(rdata.chunk_buf);
+
+	/* Rather keep the previous results than write incomplete ones */
+	if (ret) {
+		ERR("Keeping the previous %s, the region file kept changing "
+				"while being read", filename);
+		goto out;
+	}
+	/* Without coordinates, the signs of skipped chunks can not be told
+	 * apart from the others */
+	if (rdata.skipped != NULL && !has_coords) {
+		ERR("Keeping the previous %s, some chunks could not be read",
+				filename);
+		goto out;
+	}
+
+	/* Chunks are visited in file order and signs pushed to the head of the
+	 * queue, so sort them to get the same output for the same world */
+	g_queue_sort(rdata.signs, queue_sign_compare, NULL);
+
+	/* Compare against the previous run, and write the output file, or
+	 * remove it if nothing was found in the region file */
+	update_state(state_filename, &rdata);
+	if (!opt_no_snapshot)
+		write_snapshot(filename, rdata.signs);
+	if (opt_index)
+		write_tokens(tokens_filename, &rdata);
+
+out:
+	free(rdata.skipped);
+	g_queue_free_full(rdata.signs, (GDestroyNotify)sign_free);
+	if (rdata.other_signs != NULL)
+		g_queue_free_full(rdata.other_signs,
+				(GDestroyNotify)sign_free);
+	free(tokens_filename);
+	free(state_filename);
+	free(filename);
+	region_close(region);
+}
+
+struct input_context {
+	char *buffer;
+	int bsize;
+	int bpos;
+};
+
+void init_input_context(struct input_context *ic) {
+	ic->buffer = malloc(1024);
+	if (ic->buffer == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+	ic->bsize = 1024;
+	ic->bpos = 0;
+}
+
+int static inline does_match(char c) {
+	switch (c) {
+	case '\t':
+	case '\n':
+	case '\r':
+	case ' ':
+		if (opt_input_format == white_space)
+			return 1;
+		break;
+
+	case 0:
+		if (opt_input_format == null)
+			return 1;
+		break;
+	}
+
+	return 0;
+}
+
+char *get_input(struct input_context *ic) {
+	ssize_t r;
+	char *tmp;
+	int i, start_position;
+
+	/* Real EOF indication */
+	if (ic->buffer == NULL)
+		return NULL;
+	
+	while (1) {
+		/* Skip past any matched delimiter-characters in the beginning
+		 * of the buffer */
+		i = 0;
+		while (i < ic->bpos && does_match(ic->buffer[i]))
+			i++;
+
+		/* Record start and search for next delimiter */
+		start_position = i;
+		while (i < ic->bpos && !does_match(ic->buffer[i]))
+			i++;
+
+		/* Do we have a match? */
+		if (i <= ic->bpos && does_match(ic->buffer[i])
+					&& i != start_position) {
+			ic->buffer[i] = 0;
+
+			tmp = strdup(&ic->buffer[start_position]);
+
+			/* Increment i, as it is now pointing to the end of
+			 * the previous delimited substring */
+			i++;
+			/* Anything worth saving? */
+			if (i < ic->bpos)
+				memmove(ic->buffer, &ic->buffer[i],
+						ic->bpos - i);
+			ic->bpos -= i;
+
+			return tmp;
+		}
+
+		/* Do a read */
+		r = read(STDIN_FILENO, &ic->buffer[ic->bpos],
+				ic->bsize - ic->bpos);
+		ic->bpos += r;
+		/* Handle EOF */
+		if (r == 0) {
+			free(ic->buffer);
+			ic->buffer = NULL;
+			return NULL;
+		}
+
+		/* Grow buffer if we hit the ceiling */
+		if (ic->bpos == ic->bsize) {
+			ic->buffer = realloc(ic->buffer, ic->bsize * 2);
+			if (ic->buffer == NULL) {
+				perror("mcsign");
+				exit(1);
+			}
+			ic->bsize *= 2;
+		}
+
+	}
+
+}
+
+void print_help(void) {
+	ERR0("Usage: mcsign [ OPTIONS ]");
+	ERR0("Fetches sign data from Minecraft region files and outputs data to one file");
+	ERR0("per region file read.");
+	ERR0("");
+	ERR0("Mandatory arguments to long options are mandatory for short options too.");
+	ERR0("  -0, --null               data on standard is terminated by a null characted");
+	ERR0("                           (like find -print0 and xargs -0");
+	ERR0("  -f, --format=FORMAT      specify how the output is to be formatted. If this");
+	ERR0("                           argument is not specified, the default format will");
 	ERR0("                           be used (see below).");
 	ERR0("  -o, --output-path=PATH   where files containing sign information will be");
 	ERR0("                           written, one for each .mca or .mcr that contains");
@@ -475,9 +1540,62 @@ void print_help(void) {
 	ERR0("                           to be output in these");
 	ERR0("  -t, --threads=THREADS    the number of worker threads to be spawned,");
 	ERR( "                           default: %d", DEFAULT_WORKERS);
+	ERR0("  -z, --compress=METHODS   also write compressed siblings of each output file,");
+	ERR0("                           METHODS is a comma separated list of gzip (.gz),");
+	ERR0("                           br (.br) or all. Siblings are only regenerated when");
+	ERR0("                           the output they are made from has changed");
+	ERR0("  -Z, --compress-only      do not scan anything, instead read paths of arbitrary");
+	ERR0("                           files (e.g. markers.js) on standard input and write");
+	ERR0("                           their compressed siblings. Uses all methods unless");
+	ERR0("                           --compress is given");
+	ERR0("  -e, --events=FILE        write an event for each sign that was added, removed");
+	ERR0("                           or modified since the previous run to FILE, or to");
+	ERR0("                           standard out if FILE is -");
+	ERR0("  -E, --event-format=FORMAT");
+	ERR0("                           specify how events are formatted, see below");
+	ERR0("  -n, --no-snapshot        do not write the per region output files, only");
+	ERR0("                           keep track of changes (for use with --events)");
+	ERR0("  -b, --bbox=X1,Z1,X2,Z2[,Y1,Y2]");
+	ERR0("                           only look for signs within the given block");
+	ERR0("                           coordinates (inclusive). Regions and chunks that do");
+	ERR0("                           not overlap the box are never read, judging from");
+	ERR0("                           their r.X.Z file names. Signs of the previous run");
+	ERR0("                           outside of the box are kept as they were, without");
+	ERR0("                           any events");
+	ERR0("  -s, --survey             do not scan anything, only read the headers of the");
+	ERR0("                           region files and print statistics about their");
+	ERR0("                           chunks, largest region first, and what a full scan");
+	ERR0("                           would cost. Honors --bbox");
+	ERR0("  -i, --index              keep a full text index of the signs in the output");
+	ERR0("                           path, to be searched with mcsign query");
+	ERR0("  -a, --index-all          like --index, but index all signs and not only those");
+	ERR0("                           that are output");
+	ERR0("  -S, --shard=I/N          only scan the regions in shard I of N (counting from");
+	ERR0("                           0), assigned from their coordinates the same way on");
+	ERR0("                           all hosts. Afterwards, all signs of the shard found");
+	ERR0("                           in the output path are written to a partial result");
+	ERR0("  -p, --partial=FILE       where to write the partial result, default:");
+	ERR0("                           PATH/shard-I-of-N.partial");
+	ERR0("  -P, --publish=FILE       after the scan, write the signs of all regions in");
+	ERR0("                           the output path to FILE, sorted by dimension and");
+	ERR0("                           x, z and y coordinates. FILE is only replaced if");
+	ERR0("                           its content changed, and the SHA-256 of the content");
+	ERR0("                           is written to FILE.etag. Honors --compress");
+	ERR0("  -H, --header=TEXT        write TEXT on a line of its own before the signs in");
+	ERR0("                           the published file");
+	ERR0("  -F, --footer=TEXT        write TEXT on a line of its own after the signs in");
+	ERR0("                           the published file");
+	ERR0("  -L, --live               scan a world that the server is saving at the same");
+	ERR0("                           time. Chunks are checked against the region header,");
+	ERR0("                           and those that turn out to be inconsistent or to");
+	ERR0("                           have changed during the scan are read again. A");
+	ERR0("                           region that does not settle is skipped, keeping the");
+	ERR0("                           results of the previous run");
+	ERR( "  -R, --retries=N          times to read changed chunks again, default: %d",
+			DEFAULT_LIVE_RETRIES);
 	ERR0("  -h, --help               display this help and exit");
 	ERR0("");
-	ERR0("Output path is a required argument.");
+	ERR0("Output path is a required argument, except with --compress-only and --survey.");
 	ERR0("");
 	ERR0("When started, mcsign will read region file paths on standard input, waiting");
 	ERR0("for an end of file.");
@@ -492,32 +1610,99 @@ void print_help(void) {
 	ERR0("  %%x  X coordinate of the sign");
 	ERR0("  %%y  Y coordinate of the sign");
 	ERR0("  %%z  Z coordinate of the sign");
+	ERR0("  %%e  Event type: add, remove or modify (event format only)");
+	ERR0("  %%%%  A literal %%");
+	ERR0("");
+	ERR0("Default event format:");
+	ERR( "%s", DEFAULT_EVENT_FORMAT);
+	ERR0("Removed signs are output with the text they had in the previous run.");
+	ERR0("");
+	ERR0("Note: Signs found in each region file are recorded in a .state file next to");
+	ERR0("      the output file. Events are the differences against these, so a region");
+	ERR0("      file that is not given on standard in does not cause any events.");
 	ERR0("");
 	ERR0("Note: mcsign will erase any existing output file corresponding");
 	ERR0("      to a region file if the region file is determined to not");
 	ERR0("      contain a matching sign. This is done to enable");
 	ERR0("      incremental re-runs.");
 	ERR0("");
-	ERR0("Note: Destination file names are generated from the source file name, meaning");
-	ERR0("      that if two source files with the same file name (e.g. region/r.0.0.mca");
-	ERR0("      and region/DIM-1/r.0.0.mca) is written to standard in, the first output");
-	ERR0("      file will be overwritten.");
+	ERR0("Note: Destination file names are generated from the source file name, with");
+	ERR0("      the dimension in front outside of the overworld (e.g. DIM-1/region/r.0.0.mca");
+	ERR0("      gives DIM-1.r.0.0.mca.sign). If two source files with the same file name in");
+	ERR0("      the same dimension are written to standard in, the first output file will");
+	ERR0("      be overwritten.");
+	ERR0("");
+	ERR0("To search the index, use:");
+	ERR0("  mcsign query -o PATH WORD...");
+	ERR0("");
+	ERR0("To combine the partial results of all shards into one output file, use:");
+	ERR0("  mcsign merge [ -f FORMAT ] [ -o FILE ] [ -H TEXT ] [ -F TEXT ] PARTIAL...");
 	ERR0("");
 	ERR0("mcsign home page: <http://github.com/zqad/mcsign/>");
 }
 
+static inline void order(int32_t *lo, int32_t *hi) {
+	int32_t tmp;
+
+	if (*lo > *hi) {
+		tmp = *lo;
+		*lo = *hi;
+		*hi = tmp;
+	}
+}
+
+/* Parse X1,Z1,X2,Z2[,Y1,Y2] */
+static int parse_bbox(const char *arg, struct bbox *bbox) {
+	int n = 0;
+	int ret;
+
+	ret = sscanf(arg, "%d,%d,%d,%d%n,%d,%d%n", &bbox->x1, &bbox->z1,
+			&bbox->x2, &bbox->z2, &n, &bbox->y1, &bbox->y2, &n);
+	if ((ret != 4 && ret != 6) || arg[n] != 0)
+		return -EINVAL;
+
+	if (ret == 4) {
+		bbox->y1 = INT32_MIN;
+		bbox->y2 = INT32_MAX;
+	}
+
+	order(&bbox->x1, &bbox->x2);
+	order(&bbox->y1, &bbox->y2);
+	order(&bbox->z1, &bbox->z2);
+	bbox->set = 1;
+
+	return 0;
+}
+
 static int parse_options(int argc, char *argv[]) {
 	char opt;
 	int option_index = 0;
+	int n = 0;
 	static struct option long_options[] = {
 		{"help",        no_argument,       0,  0 },
 		{"format",      required_argument, 0,  0 },
 		{"output-path", required_argument, 0,  0 },
 		{"threads",     required_argument, 0,  0 },
 		{"null",        required_argument, 0,  0 },
+		{"compress",    required_argument, 0,  0 },
+		{"compress-only", no_argument,     0,  0 },
+		{"bbox",        required_argument, 0,  0 },
+		{"events",      required_argument, 0,  0 },
+		{"event-format", required_argument, 0, 0 },
+		{"no-snapshot", no_argument,       0,  0 },
+		{"survey",      no_argument,       0,  0 },
+		{"index",       no_argument,       0,  0 },
+		{"index-all",   no_argument,       0,  0 },
+		{"shard",       required_argument, 0,  0 },
+		{"partial",     required_argument, 0,  0 },
+		{"publish",     required_argument, 0,  0 },
+		{"header",      required_argument, 0,  0 },
+		{"footer",      required_argument, 0,  0 },
+		{"live",        no_argument,       0,  0 },
+		{"retries",     required_argument, 0,  0 },
 		{0,             0,                 0,  0 }
 	};
-	const char *short_options = "hf:o:t:0";
+	const char *short_options = "hf:o:t:0z:Zb:e:E:nsiaS:p:P:H:F:LR:";
 
 	while (1) {
 		opt = getopt_long(argc, argv, short_options,
@@ -540,8 +1725,56 @@ static int parse_options(int argc, char *argv[]) {
 			case 3:
 				opt = 't';
 				break;
-			case 4:
-				opt = '0';
+			case 4:
+				opt = '0';
+				break;
+			case 5:
+				opt = 'z';
+				break;
+			case 6:
+				opt = 'Z';
+				break;
+			case 7:
+				opt = 'b';
+				break;
+			case 8:
+				opt = 'e';
+				break;
+			case 9:
+				opt = 'E';
+				break;
+			case 10:
+				opt = 'n';
+				break;
+			case 11:
+				opt = 's';
+				break;
+			case 12:
+				opt = 'i';
+				break;
+			case 13:
+				opt = 'a';
+				break;
+			case 14:
+				opt = 'S';
+				break;
+			case 15:
+				opt = 'p';
+				break;
+			case 16:
+				opt = 'P';
+				break;
+			case 17:
+				opt = 'H';
+				break;
+			case 18:
+				opt = 'F';
+				break;
+			case 19:
+				opt = 'L';
+				break;
+			case 20:
+				opt = 'R';
 				break;
 			}
 		}
@@ -566,14 +1799,87 @@ static int parse_options(int argc, char *argv[]) {
 		case '0':
 			opt_input_format = null;
 			break;
+		case 'z':
+			opt_compress = compress_parse_methods(optarg);
+			if (opt_compress < 0) {
+				ERR("Unknown compression method in '%s'", optarg);
+				exit(1);
+			}
+			break;
+		case 'Z':
+			opt_compress_only = 1;
+			break;
+		case 'e':
+			opt_events_path = optarg;
+			break;
+		case 'E':
+			opt_event_format = optarg;
+			break;
+		case 'n':
+			opt_no_snapshot = 1;
+			break;
+		case 's':
+			opt_survey = 1;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%u/%u%n", &opt_shard, &opt_shards,
+						&n) != 2 || optarg[n] != 0 ||
+					opt_shards < 1 ||
+					opt_shard >= opt_shards) {
+				ERR0("Shard expected to be I/N, with I < N");
+				exit(1);
+			}
+			break;
+		case 'p':
+			opt_partial_path = optarg;
+			break;
+		case 'P':
+			opt_publish_path = optarg;
+			break;
+		case 'H':
+			opt_header = optarg;
+			break;
+		case 'F':
+			opt_footer = optarg;
+			break;
+		case 'L':
+			opt_live = 1;
+			break;
+		case 'R':
+			if (sscanf(optarg, "%u%n", &opt_live_retries, &n) != 1 ||
+					optarg[n] != 0) {
+				ERR0("Number of retries expected to be >=0");
+				exit(1);
+			}
+			break;
+		case 'a':
+			opt_index_all = 1;
+			/* Fall through */
+		case 'i':
+			opt_index = 1;
+			break;
+		case 'b':
+			if (parse_bbox(optarg, &opt_bbox)) {
+				ERR("Invalid bounding box '%s'", optarg);
+				exit(1);
+			}
+			break;
 		default:
 			exit(1);
 			break;
 		}
 	}
 
+	if (opt_compress_only && opt_compress == 0)
+		opt_compress = COMPRESS_ALL;
+
+	if (opt_publish_path != NULL && opt_shards > 0) {
+		ERR0("A shard can not be published, merge the partial results instead");
+		exit(1);
+	}
+
 	/* Check that we got all info needed */
-	if (opt_output_path == NULL) {
+	if (opt_output_path == NULL && !opt_compress_only && !opt_survey) {
 		ERR0("Output path is a required argument");
 		exit(1);
 	}
@@ -581,6 +1887,485 @@ static int parse_options(int argc, char *argv[]) {
 	return optind;
 }
 
+/* Push one work item per compression method, so that the siblings of a
+ * single file are produced in parallel. Takes ownership of filename. */
+static void push_compress_work(GThreadPool *worker_pool,
+		GAsyncQueue *buffer_queue, char *filename) {
+	enum compress_method method;
+	struct work *work;
+	GError *gerror;
+
+	for (method = compress_gzip; method <= compress_brotli; method <<= 1) {
+		if (!(opt_compress & method))
+			continue;
+
+		work = (struct work *)g_async_queue_pop(buffer_queue);
+		work->filename = strdup(filename);
+		work->compress = method;
+		if (work->filename == NULL) {
+			perror("mcsign");
+			exit(1);
+		}
+
+		if (!g_thread_pool_push(worker_pool, work, &gerror)) {
+			ERR("Error while pushing work to pool: %s",
+					gerror->message);
+			exit(1);
+		}
+	}
+
+	free(filename);
+}
+
+static void write_partial_line(const char *line, void *user_data) {
+	FILE *fp = (FILE *)user_data;
+
+	if (fputs(line, fp) == EOF || fputc('\n', fp) == EOF) {
+		ERR("Error while writing partial result: %d", errno);
+		exit(1);
+	}
+}
+
+/* Load the state files in the output path as sorted runs, only those of this
+ * shard if sharding. Returns the runs, and the number of them in n. */
+static struct run *load_state_runs(unsigned int *n) {
+	GPtrArray *filenames;
+	GError *gerror = NULL;
+	struct run *runs;
+	const gchar *name;
+	char *region_name;
+	unsigned int i;
+	GDir *dir;
+
+	dir = g_dir_open(opt_output_path, 0, &gerror);
+	if (dir == NULL) {
+		ERR("Unable to open %s: %s", opt_output_path, gerror->message);
+		exit(1);
+	}
+
+	filenames = g_ptr_array_new();
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		if (!g_str_has_suffix(name, STATE_SUFFIX))
+			continue;
+
+		/* The output path may be shared with other shards */
+		region_name = g_strndup(name,
+				strlen(name) - strlen(STATE_SUFFIX));
+		if (opt_shards == 0 || shard_of(region_name) == opt_shard)
+			g_ptr_array_add(filenames, g_strdup_printf("%s/%s",
+						opt_output_path, name));
+		g_free(region_name);
+	}
+	g_dir_close(dir);
+
+	runs = calloc(filenames->len + 1, sizeof(struct run));
+	if (runs == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+	*n = 0;
+	for (i = 0; i < filenames->len; i++) {
+		if (run_load(&runs[*n], g_ptr_array_index(filenames, i)) == 0)
+			(*n)++;
+		else
+			ERR("Unable to read %s",
+					(char *)g_ptr_array_index(filenames, i));
+	}
+
+	for (i = 0; i < filenames->len; i++)
+		g_free(g_ptr_array_index(filenames, i));
+	g_ptr_array_free(filenames, TRUE);
+
+	return runs;
+}
+
+/* Merge the state files of all regions in this shard into one sorted partial
+ * result, headed by a line describing where it came from */
+static void write_partial(void) {
+	struct run *runs;
+	char *filename, *tmp_filename;
+	unsigned int i, n;
+	FILE *fp;
+
+	runs = load_state_runs(&n);
+
+	if (opt_partial_path != NULL)
+		filename = g_strdup(opt_partial_path);
+	else
+		filename = g_strdup_printf("%s/shard-%u-of-%u.partial",
+				opt_output_path, opt_shard, opt_shards);
+	tmp_filename = g_strdup_printf("%s.tmp", filename);
+
+	fp = fopen(tmp_filename, "w");
+	if (fp == NULL) {
+		ERR("Unable to open partial result %s: %d", tmp_filename,
+				errno);
+		exit(1);
+	}
+
+	fprintf(fp, "%s %d shard %u/%u regions %u\n", PARTIAL_MAGIC,
+			PARTIAL_VERSION, opt_shard, opt_shards, n);
+	merge_runs(runs, n, sign_line_compare, 0, write_partial_line, fp);
+
+	if (fclose(fp) || rename(tmp_filename, filename)) {
+		ERR("Error while writing partial result %s: %d", filename,
+				errno);
+		exit(1);
+	}
+	PROBE2(output__flush, filename, 1);
+
+	for (i = 0; i < n; i++)
+		run_free(&runs[i]);
+	free(runs);
+	g_free(tmp_filename);
+	g_free(filename);
+}
+
+struct merge_output {
+	FILE *fp;
+	const char *format;
+};
+
+static void output_merged_line(const char *line, void *user_data) {
+	struct merge_output *output = (struct merge_output *)user_data;
+	struct sign *sign;
+	char *copy;
+	int error;
+
+	/* Parsing modifies the line, which still belongs to its run */
+	copy = strdup(line);
+	if (copy == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	sign = sign_parse(copy, &error);
+	if (sign == NULL) {
+		ERR("Skipping malformed line in partial result: %s", line);
+	}
+	else {
+		outf(output->fp, output->format, sign, NULL);
+		sign_free(sign);
+	}
+
+	free(copy);
+}
+
+/* Write the merged runs in format, between optional header and footer
+ * lines */
+static void write_merged(FILE *fp, struct run *runs, unsigned int n,
+		const char *format, const char *header, const char *footer) {
+	struct merge_output output = { fp, format };
+
+	if (header != NULL && fprintf(fp, "%s\n", header) < 0) {
+		ERR("Error while writing output: %d", errno);
+		exit(1);
+	}
+	merge_runs(runs, n, sign_line_compare, 0, output_merged_line,
+			&output);
+	if (footer != NULL && fprintf(fp, "%s\n", footer) < 0) {
+		ERR("Error while writing output: %d", errno);
+		exit(1);
+	}
+}
+
+/* A stream that hashes everything on its way to the real file */
+struct hashed_file {
+	FILE *fp;
+	GChecksum *checksum;
+};
+
+static ssize_t hashed_write(void *cookie, const char *buf, size_t size) {
+	struct hashed_file *hashed = (struct hashed_file *)cookie;
+
+	g_checksum_update(hashed->checksum, (const guchar *)buf, size);
+	if (fwrite(buf, 1, size, hashed->fp) != size)
+		return -1;
+
+	return size;
+}
+
+static int hashed_close(void *cookie) {
+	struct hashed_file *hashed = (struct hashed_file *)cookie;
+
+	return fclose(hashed->fp);
+}
+
+/* Write the merged runs to filename, with the SHA-256 of the content as a
+ * quoted ETag in filename.etag. If the ETag is unchanged, filename is left
+ * alone, keeping its mtime and compressed siblings. Returns 1 if filename
+ * was replaced and 0 if not. */
+static int publish_runs(const char *filename, struct run *runs,
+		unsigned int n, const char *format, const char *header,
+		const char *footer) {
+	cookie_io_functions_t io = { NULL, hashed_write, NULL, hashed_close };
+	struct hashed_file hashed;
+	char *tmp_filename, *etag_filename, *etag, *old_etag = NULL;
+	GError *gerror = NULL;
+	struct stat stat_buf;
+	FILE *fp;
+	int changed;
+
+	tmp_filename = g_strdup_printf("%s.tmp", filename);
+	etag_filename = g_strdup_printf("%s%s", filename, ETAG_SUFFIX);
+
+	hashed.fp = fopen(tmp_filename, "w");
+	if (hashed.fp == NULL) {
+		ERR("Unable to open output file %s: %d", tmp_filename, errno);
+		exit(1);
+	}
+	hashed.checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	fp = fopencookie(&hashed, "w", io);
+	if (fp == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	write_merged(fp, runs, n, format, header, footer);
+	if (fclose(fp)) {
+		ERR("Error while writing to file %s: %d", tmp_filename, errno);
+		exit(1);
+	}
+
+	etag = g_strdup_printf("\"%s\"\n",
+			g_checksum_get_string(hashed.checksum));
+	changed = stat(filename, &stat_buf) != 0 ||
+		!g_file_get_contents(etag_filename, &old_etag, NULL, NULL) ||
+		strcmp(old_etag, etag) != 0;
+
+	if (!changed) {
+		unlink(tmp_filename);
+	}
+	else {
+		if (rename(tmp_filename, filename)) {
+			ERR("Unable to rename %s to %s: %d", tmp_filename,
+					filename, errno);
+			exit(1);
+		}
+		/* Written after the file itself, so that a crash in between
+		 * only causes one extra rewrite */
+		if (!g_file_set_contents(etag_filename, etag, -1, &gerror)) {
+			ERR("Unable to write %s: %s", etag_filename,
+					gerror->message);
+			exit(1);
+		}
+	}
+	PROBE2(output__flush, filename, changed);
+
+	g_checksum_free(hashed.checksum);
+	g_free(old_etag);
+	g_free(etag);
+	g_free(etag_filename);
+	g_free(tmp_filename);
+
+	return changed;
+}
+
+/* Merge the state files of all regions in the output path into
+ * opt_publish_path. Its compressed siblings are left to the workers. */
+static void publish(void) {
+	struct run *runs;
+	unsigned int i, n;
+
+	runs = load_state_runs(&n);
+	publish_runs(opt_publish_path, runs, n, opt_output_format, opt_header,
+			opt_footer);
+
+	for (i = 0; i < n; i++)
+		run_free(&runs[i]);
+	free(runs);
+}
+
+void print_merge_help(void) {
+	ERR0("Usage: mcsign merge [ OPTIONS ] PARTIAL...");
+	ERR0("Combines the partial results written by mcsign --shard into one output");
+	ERR0("file, sorted by dimension and x, z and y coordinates.");
+	ERR0("");
+	ERR0("  -f, --format=FORMAT      specify how the output is to be formatted, as for");
+	ERR0("                           a normal run");
+	ERR0("  -o, --output=FILE        write to FILE instead of standard out. FILE is only");
+	ERR0("                           replaced if its content changed, and the SHA-256");
+	ERR0("                           of the content is written to FILE.etag");
+	ERR0("  -H, --header=TEXT        write TEXT on a line of its own before the signs");
+	ERR0("  -F, --footer=TEXT        write TEXT on a line of its own after the signs");
+	ERR0("  -h, --help               display this help and exit");
+}
+
+static int merge_main(int argc, char *argv[]) {
+	const char *format = DEFAULT_OUTPUT_FORMAT;
+	char *filename = NULL, *header_text = NULL, *footer_text = NULL;
+	unsigned int shard, shards, regions, expected = 0;
+	unsigned char *seen = NULL;
+	struct run *runs;
+	const char *header;
+	int version;
+	int opt, i, n;
+	static struct option long_options[] = {
+		{"help",        no_argument,       0, 'h' },
+		{"format",      required_argument, 0, 'f' },
+		{"output",      required_argument, 0, 'o' },
+		{"header",      required_argument, 0, 'H' },
+		{"footer",      required_argument, 0, 'F' },
+		{0,             0,                 0,  0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "hf:o:H:F:", long_options,
+					NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			format = optarg;
+			break;
+		case 'o':
+			filename = optarg;
+			break;
+		case 'H':
+			header_text = optarg;
+			break;
+		case 'F':
+			footer_text = optarg;
+			break;
+		case 'h':
+		default:
+			print_merge_help();
+			exit(1);
+		}
+	}
+
+	n = argc - optind;
+	if (n == 0) {
+		print_merge_help();
+		exit(1);
+	}
+
+	runs = calloc(n, sizeof(struct run));
+	if (runs == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+
+	/* Check that the partials belong together before merging anything */
+	for (i = 0; i < n; i++) {
+		if (run_load(&runs[i], argv[optind + i])) {
+			ERR("Unable to read %s", argv[optind + i]);
+			exit(1);
+		}
+
+		header = run_peek(&runs[i]);
+		if (header == NULL || sscanf(header, PARTIAL_MAGIC
+					" %d shard %u/%u regions %u", &version,
+					&shard, &shards, &regions) != 4 ||
+				version != PARTIAL_VERSION) {
+			ERR("%s is not a partial result", argv[optind + i]);
+			exit(1);
+		}
+		run_next(&runs[i]);
+
+		if (seen == NULL) {
+			seen = calloc(shards, 1);
+			if (seen == NULL) {
+				perror("mcsign");
+				exit(1);
+			}
+			expected = shards;
+		}
+		if (shards != expected || shard >= shards) {
+			ERR("%s is from a different set of shards",
+					argv[optind + i]);
+			exit(1);
+		}
+		if (seen[shard]) {
+			ERR("Shard %u/%u given more than once", shard, shards);
+			exit(1);
+		}
+		seen[shard] = 1;
+	}
+
+	if (n != expected)
+		ERR("Warning: merging %d of %u shards", n, expected);
+
+	if (filename != NULL) {
+		publish_runs(filename, runs, n, format, header_text,
+				footer_text);
+	}
+	else {
+		write_merged(stdout, runs, n, format, header_text,
+				footer_text);
+		if (fflush(stdout)) {
+			ERR("Error while writing output: %d", errno);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		run_free(&runs[i]);
+	free(runs);
+	free(seen);
+
+	return 0;
+}
+
+void print_query_help(void) {
+	ERR0("Usage: mcsign query -o PATH WORD...");
+	ERR0("Searches the index built by mcsign --index for signs containing all of the");
+	ERR0("given words, and prints their dimension and x, y and z coordinates.");
+	ERR0("");
+	ERR0("  -o, --output-path=PATH   the output path that the index was built in");
+	ERR0("  -h, --help               display this help and exit");
+	ERR0("");
+	ERR0("Words are matched case insensitively. A word ending with * matches all");
+	ERR0("words starting with it.");
+}
+
+static int query_main(int argc, char *argv[]) {
+	char *path = NULL;
+	int opt;
+	int ret;
+	static struct option long_options[] = {
+		{"help",        no_argument,       0, 'h' },
+		{"output-path", required_argument, 0, 'o' },
+		{0,             0,                 0,  0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "ho:", long_options,
+					NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			path = optarg;
+			break;
+		case 'h':
+		default:
+			print_query_help();
+			exit(1);
+		}
+	}
+
+	if (path == NULL || optind == argc) {
+		print_query_help();
+		exit(1);
+	}
+
+	ret = index_query(path, &argv[optind], argc - optind, stdout);
+	if (ret < 0)
+		return 1;
+
+	/* Like grep, exit with 1 if nothing was found */
+	return ret == 0;
+}
+
+static GThreadPool *start_workers(GAsyncQueue *buffer_queue) {
+	GThreadPool *worker_pool;
+	GError *gerror = NULL;
+
+	worker_pool = g_thread_pool_new(worker, buffer_queue, opt_workers,
+			TRUE, &gerror);
+	if (worker_pool == NULL) {
+		ERR("Error while allocating pool: %s", gerror->message);
+		exit(1);
+	}
+
+	return worker_pool;
+}
+
 int main(int argc, char *argv[]) {
 	int i;
 	char *filename;
@@ -590,9 +2375,30 @@ int main(int argc, char *argv[]) {
 	GError *gerror;
 	GThreadPool *worker_pool;
 	struct input_context input_context;
+	char *index_filename;
+
+	if (argc > 1 && strcmp(argv[1], "query") == 0)
+		return query_main(argc - 1, &argv[1]);
+	if (argc > 1 && strcmp(argv[1], "merge") == 0)
+		return merge_main(argc - 1, &argv[1]);
 
 	parse_options(argc, argv);
 
+	if (opt_survey)
+		surveys = g_ptr_array_new();
+
+	if (opt_events_path != NULL && strcmp(opt_events_path, "-") == 0) {
+		events_fp = stdout;
+	}
+	else if (opt_events_path != NULL) {
+		events_fp = fopen(opt_events_path, "w");
+		if (events_fp == NULL) {
+			ERR("Unable to open event file %s: %d",
+					opt_events_path, errno);
+			exit(1);
+		}
+	}
+
 	buffer_queue = g_async_queue_new();
 
 	/* Prepare buffers, 10*workers ought to be enough for anyone */
@@ -605,18 +2411,19 @@ int main(int argc, char *argv[]) {
 		g_async_queue_push(buffer_queue, &work_buffers[i]);
 
 	/* Start workers */
-	worker_pool = g_thread_pool_new(worker, buffer_queue, opt_workers,
-			TRUE, &gerror);
-	if (worker_pool == NULL) {
-		ERR("Error while allocating pool: %s", gerror->message);
-		exit(1);
-	}
+	worker_pool = start_workers(buffer_queue);
 
 	init_input_context(&input_context);
 	while (filename = get_input(&input_context)) {
 
+		if (opt_compress_only) {
+			push_compress_work(worker_pool, buffer_queue, filename);
+			continue;
+		}
+
 		work = (struct work *)g_async_queue_pop(buffer_queue);
 		work->filename = filename;
+		work->compress = 0;
 		
 		if (!g_thread_pool_push(worker_pool, work, &gerror)) {
 			ERR("Error while pushing work to pool: %s",
@@ -631,10 +2438,56 @@ int main(int argc, char *argv[]) {
 	/* Kill workers */
 	g_thread_pool_free(worker_pool, FALSE, TRUE); /* finish queue & wait
 							 for completion */
+	worker_pool = NULL;
+
+	if (opt_survey)
+		print_survey();
+
+	if (opt_shards > 0 && !opt_survey && !opt_compress_only)
+		write_partial();
+
+	/* The published file is made from the results of all workers, so its
+	 * compressed siblings are written by a new round of workers, one per
+	 * method, while the index is rebuilt below */
+	if (opt_publish_path != NULL && !opt_survey && !opt_compress_only) {
+		publish();
+		if (opt_compress != 0) {
+			worker_pool = start_workers(buffer_queue);
+			filename = strdup(opt_publish_path);
+			if (filename == NULL) {
+				perror("mcsign");
+				exit(1);
+			}
+			push_compress_work(worker_pool, buffer_queue,
+					filename);
+		}
+	}
+
+	/* Only merge the token files if any of them changed */
+	if (opt_index && !opt_survey && !opt_compress_only) {
+		if (asprintf(&index_filename, "%s/%s", opt_output_path,
+					INDEX_FILENAME) < 0) {
+			perror("mcsign");
+			exit(1);
+		}
+		if ((g_atomic_int_get(&index_dirty) ||
+					access(index_filename, F_OK) != 0) &&
+				index_rebuild(opt_output_path))
+			exit(1);
+		free(index_filename);
+	}
+
+	if (worker_pool != NULL)
+		g_thread_pool_free(worker_pool, FALSE, TRUE);
 
 	g_async_queue_unref(buffer_queue);
 	/* All workers has exited, so we can safely free the work buffers */
 	free(work_buffers);
 
+	if (events_fp != NULL && fclose(events_fp)) {
+		ERR("Error while writing events: %d", errno);
+		exit(1);
+	}
+
 	return 0;
 }
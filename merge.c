@@ -0,0 +1,183 @@
+/*
+ * merge - k-way merge of sorted runs of lines
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "merge.h"
+
+int run_load(struct run *run, const char *filename) {
+	struct stat stat_buf;
+	size_t left;
+	ssize_t part;
+	char *it;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &stat_buf)) {
+		close(fd);
+		return -errno;
+	}
+
+	/* One extra byte to terminate a last line without newline */
+	run->data = malloc(stat_buf.st_size + 1);
+	if (run->data == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	it = run->data;
+	left = stat_buf.st_size;
+	while (left > 0) {
+		part = read(fd, it, left);
+		if (part < 0 && errno == EINTR)
+			continue;
+		if (part <= 0)
+			break;
+		it += part;
+		left -= part;
+	}
+	close(fd);
+
+	run->pos = run->data;
+	run->end = it;
+	*run->end = 0;
+	for (it = run->data; it < run->end; it++) {
+		if (*it == '\n')
+			*it = 0;
+	}
+
+	return 0;
+}
+
+const char *run_peek(const struct run *run) {
+	return run->pos < run->end ? run->pos : NULL;
+}
+
+void run_next(struct run *run) {
+	if (run->pos < run->end)
+		run->pos += strlen(run->pos) + 1;
+}
+
+void run_free(struct run *run) {
+	free(run->data);
+	run->data = run->pos = run->end = NULL;
+}
+
+struct heap {
+	unsigned int *items; /* Run indices */
+	unsigned int size;
+	struct run *runs;
+	int (*compare)(const char *a, const char *b);
+};
+
+static int heap_less(struct heap *heap, unsigned int a, unsigned int b) {
+	int ret;
+
+	ret = heap->compare(run_peek(&heap->runs[heap->items[a]]),
+			run_peek(&heap->runs[heap->items[b]]));
+	if (ret != 0)
+		return ret < 0;
+
+	return heap->items[a] < heap->items[b];
+}
+
+static void heap_swap(struct heap *heap, unsigned int a, unsigned int b) {
+	unsigned int tmp = heap->items[a];
+
+	heap->items[a] = heap->items[b];
+	heap->items[b] = tmp;
+}
+
+static void heap_down(struct heap *heap, unsigned int i) {
+	unsigned int smallest, child;
+
+	while (1) {
+		smallest = i;
+		child = 2 * i + 1;
+		if (child < heap->size && heap_less(heap, child, smallest))
+			smallest = child;
+		child++;
+		if (child < heap->size && heap_less(heap, child, smallest))
+			smallest = child;
+		if (smallest == i)
+			return;
+
+		heap_swap(heap, i, smallest);
+		i = smallest;
+	}
+}
+
+void merge_runs(struct run *runs, unsigned int n,
+		int (*compare)(const char *a, const char *b), int unique,
+		void (*emit)(const char *line, void *user_data),
+		void *user_data) {
+	struct heap heap;
+	struct run *run;
+	char *last = NULL;
+	const char *line;
+	unsigned int i;
+
+	heap.items = malloc(sizeof(unsigned int) * (n + 1));
+	if (heap.items == NULL) {
+		perror("mcsign");
+		exit(1);
+	}
+	heap.size = 0;
+	heap.runs = runs;
+	heap.compare = compare;
+
+	for (i = 0; i < n; i++) {
+		if (run_peek(&runs[i]) != NULL)
+			heap.items[heap.size++] = i;
+	}
+	for (i = heap.size / 2; i-- > 0;)
+		heap_down(&heap, i);
+
+	while (heap.size > 0) {
+		run = &runs[heap.items[0]];
+		line = run_peek(run);
+
+		if (!unique || last == NULL || compare(last, line) != 0) {
+			emit(line, user_data);
+			last = (char *)line;
+		}
+
+		/* Lines stay valid until the run is freed, so last can keep
+		 * pointing into it */
+		run_next(run);
+		if (run_peek(run) == NULL)
+			heap.items[0] = heap.items[--heap.size];
+		heap_down(&heap, 0);
+	}
+
+	free(heap.items);
+}
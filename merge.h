@@ -0,0 +1,54 @@
+/*
+ * merge - k-way merge of sorted runs of lines
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _MERGE_H
+#define _MERGE_H
+
+#include <stddef.h>
+
+/* A sorted run of newline separated lines, loaded into memory */
+struct run {
+	char *data;
+	char *pos; /* Next line to merge */
+	char *end;
+};
+
+/* Load a run from filename. Newlines are replaced by null characters, so
+ * that each line is a string of its own. Returns 0 on success. */
+int run_load(struct run *run, const char *filename);
+
+/* The current line of a run, or NULL if it has been consumed */
+const char *run_peek(const struct run *run);
+
+/* Step to the next line of a run */
+void run_next(struct run *run);
+
+void run_free(struct run *run);
+
+/* Merge n sorted runs, calling emit for each line in order. Lines that
+ * compare equal are taken from the run with the lowest index first, and if
+ * unique is set, only the first of them is emitted. */
+void merge_runs(struct run *runs, unsigned int n,
+		int (*compare)(const char *a, const char *b), int unique,
+		void (*emit)(const char *line, void *user_data),
+		void *user_data);
+
+#endif /* _MERGE_H */
@@ -0,0 +1,62 @@
+/*
+ * probes - static tracepoints for perf, bpftrace and systemtap
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/* All probes belong to the provider "mcsign". With <sys/sdt.h> (from
+ * systemtap-sdt-dev) each probe is a single nop plus a note in the binary,
+ * which tracers patch at runtime. Without it the probes compile to nothing.
+ *
+ * region__open fires for every region file that was opened, also in live
+ * mode where only the header is read, with the size of the file at that
+ * time. region__close fires for each of them when it is closed.
+ *
+ * Probes and their arguments:
+ *   region__open   (struct region_desc *, char *filename, off_t size)
+ *   region__close  (struct region_desc *)
+ *   chunk__start   (char *output, unsigned index, size_t compressed)
+ *   chunk__end     (char *output, unsigned index, size_t compressed,
+ *                   size_t inflated, int ok)
+ *   sign__match    (char *output, int x, int y, int z)
+ *   output__flush  (char *filename, int changed)
+ *   events__flush  (size_t bytes)
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a1) DTRACE_PROBE1(mcsign, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(mcsign, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(mcsign, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(mcsign, name, a1, a2, a3, a4)
+#define PROBE5(name, a1, a2, a3, a4, a5) \
+	DTRACE_PROBE5(mcsign, name, a1, a2, a3, a4, a5)
+#else
+#define PROBE1(name, a1) do{}while(0)
+#define PROBE2(name, a1, a2) do{}while(0)
+#define PROBE3(name, a1, a2, a3) do{}while(0)
+#define PROBE4(name, a1, a2, a3, a4) do{}while(0)
+#define PROBE5(name, a1, a2, a3, a4, a5) do{}while(0)
+#endif
+
+#endif /* _PROBES_H */
@@ -30,27 +30,55 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 #include <arpa/inet.h> /* For ntoh* */
 
 #include "region.h"
 #include "debug.h"
+#include "probes.h"
 
 static int read_all(void *buf, int fd, size_t len) {
+	char *it = buf;
 	size_t left = len;
-	size_t part;
+	ssize_t part;
 	while (left > 0) {
-		part = read(fd, buf, len);
-		if (part < 0) {
+		part = read(fd, it, left);
+		if (part < 0 && errno == EINTR)
+			continue;
+		if (part <= 0) {
 			ERR0("Short read");
 			return -EIO;
 		}
+		it += part;
 		left -= part;
 	}
 
 	return len;
 }
 
-int region_open(struct region_desc **rd, const char *filename) {
+/* Like read_all, but at offset and without moving the file position. Returns
+ * the number of bytes read, which is less than len at the end of the file. */
+static ssize_t pread_all(int fd, void *buf, size_t len, off_t offset) {
+	char *it = buf;
+	size_t left = len;
+	ssize_t part;
+
+	while (left > 0) {
+		part = pread(fd, it, left, offset + (it - (char *)buf));
+		if (part < 0 && errno == EINTR)
+			continue;
+		if (part < 0)
+			return -errno;
+		if (part == 0)
+			break;
+		it += part;
+		left -= part;
+	}
+
+	return len - left;
+}
+
+int region_open_header(struct region_desc **rd, const char *filename) {
 	int fd;
 	enum region_format format = anvil;
 	struct region_desc *desc;
@@ -69,33 +97,63 @@ int region_open(struct region_desc **rd, const char *filename) {
 
 	desc->fd = fd;
 	desc->format = format;
+	desc->mapped_file = NULL;
+	desc->mapping_size = 0;
 	/* sector_data should point right after the struct region_desc, and
 	 * the timestamps should point at that position + 4096, or + 4*1024 */
 	desc->sector_data = (uint32_t*)&desc[1];
 	desc->timestamps = &(desc->sector_data[1024]);
+	region_restrict(desc, 0, 0, REGION_CHUNKS - 1, REGION_CHUNKS - 1);
 
 	if (read_all(desc->sector_data, fd, 4096) < 0) {
+		close(fd);
 		free(desc);
 		return -EIO;
 	}
 	if (read_all(desc->timestamps, fd, 4096) < 0) {
+		close(fd);
 		free(desc);
 		return -EIO;
 	}
 
-	/* Create the memory mapping */
 	if (fstat(fd, &stat_buf)) {
+		ERR("Stat failed: %d", errno);
+		close(fd);
 		free(desc);
+		return -EIO;
+	}
+	PROBE3(region__open, desc, filename, stat_buf.st_size);
+
+	*rd = desc;
+
+	return 0;
+}
+
+int region_open(struct region_desc **rd, const char *filename) {
+	struct region_desc *desc;
+	struct stat stat_buf;
+	char *mapping;
+	int ret;
+
+	ret = region_open_header(&desc, filename);
+	if (ret)
+		return ret;
+
+	/* Create the memory mapping */
+	if (fstat(desc->fd, &stat_buf)) {
 		ERR("Stat failed: %d", errno);
+		region_close(desc);
 		return -EIO;
 	}
 
-	desc->mapped_file = mmap(NULL, stat_buf.st_size, PROT_READ,
-			MAP_PRIVATE, fd, 0);
-	if (desc->mapped_file == MAP_FAILED) {
+	mapping = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE,
+			desc->fd, 0);
+	if (mapping == MAP_FAILED) {
 		ERR("mmap failed: %d", errno);
+		region_close(desc);
 		return -EIO;
 	}
+	desc->mapped_file = mapping;
 	desc->mapping_size = stat_buf.st_size;
 
 	*rd = desc;
@@ -103,32 +161,210 @@ int region_open(struct region_desc **rd, const char *filename) {
 	return 0;
 }
 
+int region_coords_from_filename(const char *filename, int *x, int *z) {
+	const char *basename;
+	char suffix[5];
+	int n = 0;
+
+	basename = strrchr(filename, '/');
+	basename = basename == NULL ? filename : basename + 1;
+
+	if (sscanf(basename, "r.%d.%d.%4s%n", x, z, suffix, &n) != 3 ||
+			basename[n] != 0)
+		return -EINVAL;
+	if (strcmp(suffix, "mca") != 0 && strcmp(suffix, "mcr") != 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+int region_dimension_from_filename(const char *filename) {
+	const char *it = filename;
+	int dimension = 0;
+	int candidate, n;
+
+	/* Use the last DIM<n> path component, if any */
+	while (*it != 0) {
+		n = 0;
+		if (sscanf(it, "DIM%d%n", &candidate, &n) == 1 &&
+				it[n] == '/')
+			dimension = candidate;
+
+		it = strchr(it, '/');
+		if (it == NULL)
+			break;
+		it++;
+	}
+
+	return dimension;
+}
+
+static inline int clamp_chunk(int c) {
+	if (c < 0)
+		return 0;
+	if (c >= REGION_CHUNKS)
+		return REGION_CHUNKS - 1;
+	return c;
+}
+
+void region_restrict(struct region_desc *rd, int x1, int z1, int x2, int z2) {
+	rd->chunk_x1 = clamp_chunk(x1);
+	rd->chunk_z1 = clamp_chunk(z1);
+	rd->chunk_x2 = clamp_chunk(x2);
+	rd->chunk_z2 = clamp_chunk(z2);
+}
+
 int region_close(struct region_desc *rd) {
-	munmap(rd->mapped_file, rd->mapping_size);
+	PROBE1(region__close, rd);
+	if (rd->mapped_file != NULL)
+		munmap(rd->mapped_file, rd->mapping_size);
 	close(rd->fd);
 	free(rd);
+
+	return 0;
+}
+
+int region_chunk_location(const struct region_desc *rd, unsigned int index,
+		size_t *file_pos, size_t *data_size) {
+	uint32_t tmp;
+	int cx, cz;
+
+	/* Chunk (x, z) of the region is found at x + z * 32 */
+	cx = index % REGION_CHUNKS;
+	cz = index / REGION_CHUNKS;
+	if (cx < rd->chunk_x1 || cx > rd->chunk_x2 ||
+			cz < rd->chunk_z1 || cz > rd->chunk_z2)
+		return 0;
+
+	tmp = ntohl(rd->sector_data[index]);
+	*data_size = (tmp & 0xff) * 4096;
+	*file_pos = (tmp >> 8) * 4096;
+
+	return *file_pos != 0;
+}
+
+/* Check the 4 byte length and 1 byte compression type at the start of a
+ * chunk against the number of bytes that the header gives it. Returns the
+ * length of the compressed data that follows, -EAGAIN if they do not add up
+ * (as when the chunk is being rewritten) or -ENOTSUP for compression types
+ * that are not handled. */
+static ssize_t check_chunk(const unsigned char *chunk, size_t available) {
+	uint32_t length;
+
+	if (available < 5)
+		return -EAGAIN;
+
+	memcpy(&length, chunk, sizeof(length));
+	length = ntohl(length);
+	if (length < 1 || length > available - 4)
+		return -EAGAIN;
+
+	switch (chunk[4]) {
+	case CHUNK_COMPRESSION_GZIP:
+	case CHUNK_COMPRESSION_ZLIB:
+		break;
+	case 0:
+		/* Not written yet */
+		return -EAGAIN;
+	default:
+		return -ENOTSUP;
+	}
+
+	return length - 1;
+}
+
+int region_read_chunk(struct region_desc *rd, unsigned int index,
+		unsigned char **buf, size_t *buf_size, unsigned char **data,
+		size_t *len) {
+	size_t file_pos, data_size;
+	unsigned char *tmp;
+	ssize_t ret;
+
+	if (!region_chunk_location(rd, index, &file_pos, &data_size))
+		return 1;
+
+	if (*buf_size < data_size) {
+		tmp = realloc(*buf, data_size);
+		if (tmp == NULL)
+			return -ENOMEM;
+		*buf = tmp;
+		*buf_size = data_size;
+	}
+
+	ret = pread_all(rd->fd, *buf, data_size, file_pos);
+	if (ret < 0)
+		return ret;
+
+	/* The file may have been cut short since the header was read */
+	ret = check_chunk(*buf, ret);
+	if (ret < 0)
+		return ret;
+
+	*data = *buf + 5;
+	*len = ret;
+
+	return 0;
+}
+
+int region_reread_header(struct region_desc *rd, unsigned char *changed) {
+	uint32_t header[2 * REGION_CHUNKS * REGION_CHUNKS];
+	unsigned int index;
+	ssize_t ret;
+	int n = 0;
+
+	ret = pread_all(rd->fd, header, sizeof(header), 0);
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(header))
+		return -EIO;
+
+	for (index = 0; index < REGION_CHUNKS * REGION_CHUNKS; index++) {
+		changed[index] = rd->sector_data[index] != header[index] ||
+			rd->timestamps[index] !=
+			header[REGION_CHUNKS * REGION_CHUNKS + index];
+		n += changed[index];
+	}
+	memcpy(rd->sector_data, header, sizeof(header));
+
+	return n;
 }
 
 int foreach_part_in_region(struct region_desc *rd,
-		void (*func)(void *, size_t, void *), void *user_data) {
+		void (*func)(unsigned int, void *, size_t, void *),
+		void *user_data) {
 	uint32_t timestamp;
-	uint32_t tmp;
 	size_t metadata_pos, file_pos, data_size;
+	ssize_t len;
 
-	for (metadata_pos = 0; metadata_pos < 1024; metadata_pos++) {
-		tmp = ntohl(rd->sector_data[metadata_pos]);
-		data_size = (tmp & 0xff) * 4096;
-		file_pos = (tmp >> 8) * 4096;
-		if (file_pos == 0)
+	for (metadata_pos = 0; metadata_pos < REGION_CHUNKS * REGION_CHUNKS;
+			metadata_pos++) {
+		if (!region_chunk_location(rd, metadata_pos, &file_pos,
+					&data_size))
 			continue;
 		timestamp = ntohl(rd->timestamps[metadata_pos]);
 		DBG("Chunk %d: %d:%d ts:%d", metadata_pos, file_pos,
 				data_size, timestamp);
 
+		/* The header may point past the end of the mapping */
+		if (file_pos >= rd->mapping_size) {
+			ERR("Chunk %zu is outside of the file", metadata_pos);
+			continue;
+		}
+		if (file_pos + data_size > rd->mapping_size)
+			data_size = rd->mapping_size - file_pos;
+
+		len = check_chunk((unsigned char *)&rd->mapped_file[file_pos],
+				data_size);
+		if (len < 0) {
+			ERR("Skipping chunk %zu with an invalid header: %d",
+					metadata_pos, (int)-len);
+			continue;
+		}
+
 		/* Skipping 4 byte size and 1 byte compression format */
-		/* XXX: Check compression format? */
-		func(&(rd->mapped_file[file_pos + 5]), data_size - 1,
+		func(metadata_pos, &(rd->mapped_file[file_pos + 5]), len,
 				user_data);
 	}
 
+	return 0;
 }
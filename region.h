@@ -36,13 +36,71 @@ struct region_desc {
 	uint32_t *timestamps;
 	char *mapped_file;
 	off_t mapping_size;
+	/* Chunks outside of this range (in chunk coordinates local to the
+	 * region, 0-31) are skipped by foreach_part_in_region */
+	int chunk_x1, chunk_z1;
+	int chunk_x2, chunk_z2;
 };
 
+#define REGION_CHUNKS 32 /* Chunks along each side of a region */
+#define CHUNK_BLOCKS 16 /* Blocks along each side of a chunk */
+#define REGION_BLOCKS (REGION_CHUNKS * CHUNK_BLOCKS)
+
+/* Compression types in the header of each chunk */
+#define CHUNK_COMPRESSION_GZIP 1
+#define CHUNK_COMPRESSION_ZLIB 2
+
 int region_open(struct region_desc **region_desc, const char *filename);
 
+/* Like region_open, but only reads the 8 KiB header (sector_data and
+ * timestamps) without mapping the rest of the file. foreach_part_in_region
+ * may not be used on such a region_desc. */
+int region_open_header(struct region_desc **region_desc, const char *filename);
+
+/* Parse the region coordinates from a file name on the form r.X.Z.mca (or
+ * .mcr), with or without leading directories. Returns 0 on success. */
+int region_coords_from_filename(const char *filename, int *x, int *z);
+
+/* Find the dimension of a region file from a DIM<n> directory in its path,
+ * as in world/DIM-1/region/r.0.0.mca. Returns 0 (the overworld) if there is
+ * none. */
+int region_dimension_from_filename(const char *filename);
+
+/* Only visit chunks within the given local chunk coordinates (inclusive).
+ * Coordinates are clamped to the region. */
+void region_restrict(struct region_desc *region_desc, int x1, int z1,
+		int x2, int z2);
+
 int region_close(struct region_desc *region_desc);
 
+/* Get the position and (sector rounded) size of a chunk in the file. Returns
+ * 0 if the chunk does not exist or is outside of the region_restrict range. */
+int region_chunk_location(const struct region_desc *region_desc,
+		unsigned int index, size_t *file_pos, size_t *data_size);
+
+/* Read a chunk with pread instead of through the mapping, for region files
+ * that may be written to while being read. The chunk is read into *buf,
+ * which is grown as needed, and its length and compression type are checked
+ * against the header. On success, *data points at the compressed data within
+ * *buf, *len is its length and 0 is returned. Returns 1 if the chunk does not
+ * exist, -EAGAIN if it is inconsistent and another negative errno on other
+ * errors. Also works on a region_desc from region_open_header. */
+int region_read_chunk(struct region_desc *region_desc, unsigned int index,
+		unsigned char **buf, size_t *buf_size, unsigned char **data,
+		size_t *len);
+
+/* Read the header of the region file again, and set changed[index] for
+ * every chunk (of REGION_CHUNKS * REGION_CHUNKS) with a new location or
+ * timestamp. The header of region_desc is updated. Returns the number of
+ * changed chunks or a negative errno. */
+int region_reread_header(struct region_desc *region_desc,
+		unsigned char *changed);
+
+/* Call func with the index (x + z * 32), compressed data and size of every
+ * chunk in the region. Chunks with a length or compression type that does
+ * not match the header are skipped. */
 int foreach_part_in_region(struct region_desc *region_desc,
-                void (*func)(void *, size_t, void *), void *user_data);
+		void (*func)(unsigned int, void *, size_t, void *),
+		void *user_data);
 
 #endif /* _REGION_H */
@@ -7,6 +7,7 @@ MINECRAFT_DIR="$(readlink -f "$MCSIGN_DIR/../minecraft/")"
 SIGNS="$MINECRAFT_DIR/.signs"
 WORLD_DIR="$MINECRAFT_DIR/world"
 DESTINATION="$(readlink -f "$MCSIGN_DIR/../pigmap/output/markers.js")"
+COMPRESS="gzip,br" # Precompressed siblings of $DESTINATION to keep
 
 ###########
 
@@ -15,6 +16,12 @@ ts_file="$MINECRAFT_DIR/.mcsign-stamp"
 
 touch "$ts_file.new"
 
+# The published file is made from the state of every region, so scan all of
+# them if no earlier run has left any state behind
+if ! find "$SIGNS" -maxdepth 1 -name '*.state' 2>/dev/null | grep -q .; then
+  rm -f "$ts_file"
+fi
+
 if [ -e "$ts_file" ]; then
   find "$WORLD_DIR/region" -maxdepth 1 -type f -name '*.mca' -newer "$ts_file" -print0 > $changes
 else
@@ -25,13 +32,10 @@ if ! [ -d "$SIGNS" ]; then
   mkdir -p "$SIGNS"
 fi
 
-"$MCSIGN_DIR/mcsign" -o "$SIGNS" -0 < $changes
-(
-  echo "var markerData = ["
-  find "$SIGNS" -name 'signs.*.in' -print0 | xargs -0 cat
-  echo "];"
-) > "$DESTINATION.tmp"
-mv "$DESTINATION.tmp" "$DESTINATION"
+# $DESTINATION (and its precompressed siblings) is only replaced if the
+# sorted list of signs changed, with its hash in $DESTINATION.etag
+"$MCSIGN_DIR/mcsign" -o "$SIGNS" -0 -L -n -z "$COMPRESS" -P "$DESTINATION" \
+  -H "var markerData = [" -F "];" < $changes
 
 mv "$ts_file.new" "$ts_file"
 rm -f $changes
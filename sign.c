@@ -0,0 +1,267 @@
+/*
+ * sign - sign records and their on-disk representation
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sign.h"
+
+struct sign *sign_new(int dimension, int32_t x, int32_t y, int32_t z,
+		const char *text[SIGN_LINES]) {
+	struct sign *sign;
+	int i;
+
+	sign = calloc(1, sizeof(struct sign));
+	if (sign == NULL)
+		return NULL;
+
+	sign->dimension = dimension;
+	sign->x = x;
+	sign->y = y;
+	sign->z = z;
+	for (i = 0; i < SIGN_LINES; i++) {
+		sign->text[i] = strdup(text[i] != NULL ? text[i] : "");
+		if (sign->text[i] == NULL) {
+			sign_free(sign);
+			return NULL;
+		}
+	}
+
+	return sign;
+}
+
+void sign_free(struct sign *sign) {
+	int i;
+
+	if (sign == NULL)
+		return;
+
+	for (i = 0; i < SIGN_LINES; i++)
+		free(sign->text[i]);
+	free(sign);
+}
+
+unsigned int sign_hash(const void *data) {
+	const struct sign *sign = data;
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a over the position */
+	hash = (hash ^ (uint32_t)sign->dimension) * 16777619u;
+	hash = (hash ^ (uint32_t)sign->x) * 16777619u;
+	hash = (hash ^ (uint32_t)sign->y) * 16777619u;
+	hash = (hash ^ (uint32_t)sign->z) * 16777619u;
+
+	return hash;
+}
+
+int sign_key_equal(const void *data_a, const void *data_b) {
+	const struct sign *a = data_a;
+	const struct sign *b = data_b;
+
+	return a->dimension == b->dimension && a->x == b->x &&
+		a->y == b->y && a->z == b->z;
+}
+
+int sign_text_compare(const struct sign *a, const struct sign *b) {
+	int i, ret;
+
+	for (i = 0; i < SIGN_LINES; i++) {
+		ret = strcmp(a->text[i], b->text[i]);
+		if (ret != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static inline int compare_int(int32_t a, int32_t b) {
+	return a < b ? -1 : a > b;
+}
+
+int sign_compare(const struct sign *a, const struct sign *b) {
+	if (a->dimension != b->dimension)
+		return compare_int(a->dimension, b->dimension);
+	if (a->x != b->x)
+		return compare_int(a->x, b->x);
+	if (a->z != b->z)
+		return compare_int(a->z, b->z);
+	return compare_int(a->y, b->y);
+}
+
+/* Parse the position at the start of a line written by sign_write. Malformed
+ * lines get the position 0, 0, 0, 0. */
+static void parse_position(const char *line, struct sign *sign) {
+	char *end;
+
+	sign->dimension = strtol(line, &end, 10);
+	sign->x = strtol(end, &end, 10);
+	sign->y = strtol(end, &end, 10);
+	sign->z = strtol(end, &end, 10);
+}
+
+int sign_line_compare(const char *a, const char *b) {
+	struct sign sa, sb;
+	int ret;
+
+	parse_position(a, &sa);
+	parse_position(b, &sb);
+
+	ret = sign_compare(&sa, &sb);
+	if (ret != 0)
+		return ret;
+
+	return strcmp(a, b);
+}
+
+static int write_escaped(FILE *fp, const char *str) {
+	for (; *str != 0; str++) {
+		switch (*str) {
+		case '\\':
+			if (fputs("\\\\", fp) == EOF)
+				return -EIO;
+			break;
+		case '\t':
+			if (fputs("\\t", fp) == EOF)
+				return -EIO;
+			break;
+		case '\n':
+			if (fputs("\\n", fp) == EOF)
+				return -EIO;
+			break;
+		default:
+			if (fputc(*str, fp) == EOF)
+				return -EIO;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int sign_write(FILE *fp, const struct sign *sign) {
+	int i;
+
+	if (fprintf(fp, "%d\t%d\t%d\t%d", sign->dimension, sign->x, sign->y,
+				sign->z) < 0)
+		return -EIO;
+
+	for (i = 0; i < SIGN_LINES; i++) {
+		if (fputc('\t', fp) == EOF || write_escaped(fp, sign->text[i]))
+			return -EIO;
+	}
+
+	if (fputc('\n', fp) == EOF)
+		return -EIO;
+
+	return 0;
+}
+
+/* Unescape str in place, up to the next unescaped tab or the end of the
+ * string. Returns a pointer to the character after the field. */
+static char *unescape_field(char *str) {
+	char *in = str, *out = str;
+
+	while (*in != 0 && *in != '\t') {
+		if (*in == '\\' && in[1] != 0) {
+			in++;
+			switch (*in) {
+			case 't':
+				*out = '\t';
+				break;
+			case 'n':
+				*out = '\n';
+				break;
+			default:
+				*out = *in;
+				break;
+			}
+		}
+		else {
+			*out = *in;
+		}
+		in++;
+		out++;
+	}
+
+	if (*in == '\t')
+		in++;
+	*out = 0;
+
+	return in;
+}
+
+struct sign *sign_parse(char *line, int *error) {
+	const char *text[SIGN_LINES];
+	char *it, *next;
+	int dimension, x, y, z;
+	int n = 0;
+	int i;
+	struct sign *sign;
+
+	*error = 0;
+
+	/* Whitespace in the format matches any amount of it, so check the
+	 * tab in front of the first text line by hand */
+	if (sscanf(line, "%d\t%d\t%d\t%d%n", &dimension, &x, &y, &z,
+				&n) != 4 || line[n] != '\t') {
+		*error = -EINVAL;
+		return NULL;
+	}
+
+	it = &line[n + 1];
+	for (i = 0; i < SIGN_LINES; i++) {
+		next = unescape_field(it);
+		text[i] = it;
+		it = next;
+	}
+
+	sign = sign_new(dimension, x, y, z, text);
+	if (sign == NULL)
+		*error = -ENOMEM;
+
+	return sign;
+}
+
+struct sign *sign_read(FILE *fp, int *error) {
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	struct sign *sign;
+
+	*error = 0;
+
+	len = getline(&line, &line_size, fp);
+	if (len < 0) {
+		free(line);
+		return NULL;
+	}
+	if (len > 0 && line[len - 1] == '\n')
+		line[len - 1] = 0;
+
+	sign = sign_parse(line, error);
+
+	free(line);
+	return sign;
+}
@@ -0,0 +1,70 @@
+/*
+ * sign - sign records and their on-disk representation
+ *
+ * Copyright Jonas Eriksson 2012
+ *
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SIGN_H
+#define _SIGN_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIGN_LINES 4
+
+struct sign {
+	int dimension;
+	int32_t x, y, z;
+	char *text[SIGN_LINES];
+};
+
+/* Allocate a sign, copying the text lines */
+struct sign *sign_new(int dimension, int32_t x, int32_t y, int32_t z,
+		const char *text[SIGN_LINES]);
+
+void sign_free(struct sign *sign);
+
+/* Hash and equality on the position (dimension and coordinates) only, for
+ * use as GHashTable key functions */
+unsigned int sign_hash(const void *sign);
+int sign_key_equal(const void *a, const void *b);
+
+/* Compare the text of two signs, returns 0 if they are identical */
+int sign_text_compare(const struct sign *a, const struct sign *b);
+
+/* Order signs by dimension, x, z and y. Returns 0 only for signs at the same
+ * position. */
+int sign_compare(const struct sign *a, const struct sign *b);
+
+/* The same order for lines written by sign_write, with ties broken by the
+ * text so that the order is total */
+int sign_line_compare(const char *a, const char *b);
+
+/* Write a sign as one line of tab separated fields. Tabs, newlines and
+ * backslashes in the text are escaped. Returns 0 on success. */
+int sign_write(FILE *fp, const struct sign *sign);
+
+/* Read a sign written by sign_write. Returns NULL on end of file or
+ * malformed input, setting *error in the latter case. */
+struct sign *sign_read(FILE *fp, int *error);
+
+/* Parse a line written by sign_write, without the trailing newline. line is
+ * modified. Returns NULL on malformed input, setting *error. */
+struct sign *sign_parse(char *line, int *error);
+
+#endif /* _SIGN_H */